@@ -26,14 +26,334 @@ void CommandParser::parseCommandString(char *aCommand) {
 	if(hasStartMarker){
 		c++;
 	}
+#ifdef COMMANDPARSER_PROFILE
+	if (profileOut && (*c == profileKey)) {
+		dumpProfile(*profileOut);
+		return;
+	}
+	int i = findCommand(c);
+	if (i < 0) {
+		unmatched++;
+		return;
+	}
+	uint32_t startTime = micros();
+	boolean ran = runCommand(i, aCommand, c);
+	uint32_t elapsed = micros() - startTime;
+	if (!ran) {
+		badArgs++;
+		return;
+	}
+	CommandProfile &prof = profileFor(i);
+	prof.calls++;
+	prof.totalMicros += elapsed;
+	if (elapsed > prof.maxMicros) {
+		prof.maxMicros = elapsed;
+	}
+#else
+	int i = findCommand(c);
+	if (i >= 0) {
+		runCommand(i, aCommand, c);
+	}
+#endif
+
+}
+
+//  Runs every complete <...> frame in a buffer like "<A1500><B1200><C900>"
+//  in one pass.  Raw frames are skipped over by their length byte.
+//  Returns how many bytes were used up, a partial frame on the end isn't,
+//  so the caller can hang on to it and add the rest when it shows up.
+//  The frames get null terminated in place over their end marker, so the
+//  command sees the same thing it would from the string parser, less the '>'.
+int CommandParser::parseCommandFrames(char *aBuffer, int aLength) {
+
+	char *p = aBuffer;
+	char *end = aBuffer + aLength;
+	int consumed = 0;
+
+	while (p < end) {
+		char *start = (char*) memchr(p, START_OF_PACKET, end - p);
+		if (start == NULL) {
+			return aLength;
+		}
+		consumed = start - aBuffer;
+		if (end - start < 3) {
+			return consumed;
+		}
+		if ((start[1] >= 0x11) && (start[1] <= 0x14)) {
+			uint8_t rawLength = start[2];
+			if (rawLength < 3) {
+				rawLength = 3;
+			}
+			if (end - start < rawLength) {
+				return consumed;
+			}
+			p = start + rawLength;
+			consumed = p - aBuffer;
+			continue;
+		}
+		char *stop = (char*) memchr(start + 1, END_OF_PACKET, end - start - 1);
+		if (stop == NULL) {
+			return consumed;
+		}
+		// a start marker before the end means the first frame got cut off
+		char *restart = (char*) memchr(start + 1, START_OF_PACKET, stop - start - 1);
+		if (restart != NULL) {
+			p = restart;
+			continue;
+		}
+		// the end marker itself gets swapped for the null so nothing past
+		// aLength is touched, then put back
+		*stop = 0;
+		parseCommandString((hasStartMarker) ? start : start + 1);
+		*stop = END_OF_PACKET;
+		p = stop + 1;
+		consumed = p - aBuffer;
+	}
+	return consumed;
+}
+
+//  Plain commands can't fail, only an extended one's arguments can.
+boolean CommandParser::runCommand(int aIndex, char *aCommand, char *aKey) {
+	if (aIndex < numCommands) {
+		commands[aIndex].run(aCommand);
+		return true;
+	}
+	return extended[aIndex - numCommands].run(aCommand, aKey);
+}
+
+//  Returns the index of the command that c starts with or -1.
+int CommandParser::findCommand(char *c) {
+#ifdef COMMANDPARSER_TABLE
+	if (!tableBuilt) {
+		buildTable();
+	}
+	uint8_t slot = (uint8_t)*c - (uint8_t)COMMANDPARSER_TABLE_FIRST;
+	if (slot < COMMANDPARSER_TABLE_SIZE) {
+		// keywords are first in the chain, a single character command ends it
+		for (uint8_t i = table[slot]; i != COMMANDPARSER_NO_ENTRY;) {
+			if (i < numCommands) {
+				return i;
+			}
+			ExtendedCommand &com = extended[i - numCommands];
+			if ((com.kind != KEYWORD_COMMAND) || com.match(c)) {
+				return i;
+			}
+			i = com.next;
+		}
+		return -1;
+	}
+#endif
+	int single = -1;
 	for (int i = 0; i < numCommands; i++) {
 		if (commands[i].match(c)) {
-			commands[i].run(aCommand);
-			return;
+			single = i;
+			break;
 		}
 	}
+	// a keyword beats it, the longest one and the first on a tie
+	int best = -1;
+	uint8_t bestLength = 0;
+	for (int i = 0; i < numExtended; i++) {
+		ExtendedCommand &com = extended[i];
+		if (!com.match(c)) {
+			continue;
+		}
+		if (com.kind == KEYWORD_COMMAND) {
+			if (com.keyLength() > bestLength) {
+				best = numCommands + i;
+				bestLength = com.keyLength();
+			}
+		} else if (single < 0) {
+			single = numCommands + i;
+		}
+	}
+	return (best >= 0) ? best : single;
+}
 
+#ifdef COMMANDPARSER_TABLE
+
+//  Fills in which command each character goes to.  Going backwards lets the
+//  earlier commands overwrite the later ones, so the first match still wins
+//  just like the scan, and the plain ones get filled in last so they go
+//  ahead of the extended ones.  Call it again if the commands change.
+void CommandParser::buildTable() {
+	tableBuilt = true;
+	memset(table, COMMANDPARSER_NO_ENTRY, COMMANDPARSER_TABLE_SIZE);
+	for (int i = numCommands + numExtended - 1; i >= 0; i--) {
+		char m;
+		if (i < numCommands) {
+			m = commands[i].matchChar;
+		} else {
+			ExtendedCommand &com = extended[i - numCommands];
+			com.next = COMMANDPARSER_NO_ENTRY;
+			if (com.kind == KEYWORD_COMMAND) {
+				continue;
+			}
+			m = com.matchChar;
+		}
+		if (m == '#') {
+			for (char d = '0'; d <= '9'; d++) {
+				uint8_t slot = (uint8_t)d - (uint8_t)COMMANDPARSER_TABLE_FIRST;
+				if (slot < COMMANDPARSER_TABLE_SIZE) {
+					table[slot] = i;
+				}
+			}
+		}
+		uint8_t slot = (uint8_t)m - (uint8_t)COMMANDPARSER_TABLE_FIRST;
+		if (slot < COMMANDPARSER_TABLE_SIZE) {
+			table[slot] = i;
+		}
+	}
+	for (int i = 0; i < numExtended; i++) {
+		if (extended[i].kind == KEYWORD_COMMAND) {
+			chainKeyword(numCommands + i);
+		}
+	}
+}
+
+//  Puts a keyword in front of any shorter one and every single character
+//  command in its character's chain.  Those never get their next changed
+//  and always end a chain, which is what lets one '#' entry sit on the
+//  end of all ten digit chains.
+void CommandParser::chainKeyword(uint8_t aIndex) {
+	ExtendedCommand &com = extended[aIndex - numCommands];
+	uint8_t slot = (uint8_t)com.matchChar - (uint8_t)COMMANDPARSER_TABLE_FIRST;
+	if (slot >= COMMANDPARSER_TABLE_SIZE) {
+		return;
+	}
+	uint8_t len = com.keyLength();
+	uint8_t *link = &table[slot];
+	while ((*link != COMMANDPARSER_NO_ENTRY) && (*link >= numCommands)) {
+		ExtendedCommand &other = extended[*link - numCommands];
+		if ((other.kind != KEYWORD_COMMAND) || (other.keyLength() < len)) {
+			break;
+		}
+		link = &other.next;
+	}
+	com.next = *link;
+	*link = aIndex;
+}
+
+#endif
+
+#ifdef COMMANDPARSER_PROFILE
+
+//  A command starting with aKey dumps the profile to aOut instead of
+//  being dispatched.  NULL turns the query off.
+void CommandParser::setProfileQuery(char aKey, Print *aOut) {
+	profileKey = aKey;
+	profileOut = aOut;
+}
+
+CommandProfile& CommandParser::profileFor(int aIndex) {
+	if (aIndex < numCommands) {
+		return commands[aIndex].profile;
+	}
+	return extended[aIndex - numCommands].profile;
+}
+
+//  One frame per command  <Pkey,calls,totalMicros,maxMicros>
+//  then one for the misses  <P?,unmatched,badArgs>
+void CommandParser::dumpProfile(Print &aOut) {
+	for (int i = 0; i < numCommands + numExtended; i++) {
+		aOut.print("<P");
+		if (i < numCommands) {
+			aOut.print(commands[i].matchChar);
+		} else if (extended[i - numCommands].kind == KEYWORD_COMMAND) {
+			aOut.print(extended[i - numCommands].keyword);
+		} else {
+			aOut.print(extended[i - numCommands].matchChar);
+		}
+		CommandProfile &prof = profileFor(i);
+		aOut.print(',');
+		aOut.print(prof.calls);
+		aOut.print(',');
+		aOut.print(prof.totalMicros);
+		aOut.print(',');
+		aOut.print(prof.maxMicros);
+		aOut.print('>');
+	}
+	aOut.print("<P?,");
+	aOut.print(unmatched);
+	aOut.print(',');
+	aOut.print(badArgs);
+	aOut.print('>');
 }
 
+void CommandParser::clearProfile() {
+	for (int i = 0; i < numCommands + numExtended; i++) {
+		profileFor(i) = CommandProfile();
+	}
+	unmatched = 0;
+	badArgs = 0;
+}
 
+#endif
 
+//  Hand rolled instead of strtol so it can stop on our own separators
+//  and tell us if a token had junk in it.
+boolean parseCommandArgs(const char *aText, const char *aSchema, CommandArgs &aArgs) {
+	const char *p = aText;
+	aArgs.count = 0;
+	for (const char *type = aSchema; *type; type++) {
+		while (*p == ',' || *p == ' ') {
+			p++;
+		}
+		if (aArgs.count >= COMMANDPARSER_MAX_ARGS) {
+			return false;
+		}
+		boolean negative = false;
+		if (*type == 'd' && *p == '-') {
+			negative = true;
+			p++;
+		}
+		uint32_t val = 0;
+		uint8_t digits = 0;
+		if (*type == 'x') {
+			if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+				p += 2;
+			}
+			for (;; p++, digits++) {
+				char c = *p;
+				uint8_t nibble;
+				if (c >= '0' && c <= '9') {
+					nibble = c - '0';
+				} else if (c >= 'A' && c <= 'F') {
+					nibble = c - 'A' + 10;
+				} else if (c >= 'a' && c <= 'f') {
+					nibble = c - 'a' + 10;
+				} else {
+					break;
+				}
+				if (digits >= 8) {
+					return false;  // won't fit in 32 bits
+				}
+				val = (val << 4) | nibble;
+			}
+		} else if (*type == 'd' || *type == 'u') {
+			// 'd' goes to -2147483648, 'u' to 4294967295
+			uint32_t limit = (*type == 'u') ? 0xFFFFFFFFUL : ((negative) ? 0x80000000UL : 0x7FFFFFFFUL);
+			for (; *p >= '0' && *p <= '9'; p++, digits++) {
+				uint8_t digit = *p - '0';
+				if (val > (limit - digit) / 10) {
+					return false;
+				}
+				val = (val * 10) + digit;
+			}
+		} else {
+			return false;  // not a type we know
+		}
+		// has to end on a separator or the end of the command
+		if ((digits == 0)
+				|| !(*p == ',' || *p == ' ' || *p == END_OF_PACKET || *p == 0)) {
+			return false;
+		}
+		// 'u' values past 2^31 come back out with a cast to uint32_t
+		aArgs.values[aArgs.count++] = (negative) ? (int32_t) (0 - val) : (int32_t) val;
+	}
+	while (*p == ',' || *p == ' ') {
+		p++;
+	}
+	// anything left over is one argument too many
+	return (*p == END_OF_PACKET || *p == 0);
+}
@@ -22,12 +22,77 @@ CommandParser  --  allows for easy setup of single letter text commands to
 #define COMMANDPARSER_H_
 
 #include <Arduino.h>
+#include <RobotSharedDefines.h>
+
+//  parseCommandString scans the commands for a match.  Define
+//  COMMANDPARSER_TABLE to have each parser look the command character up
+//  directly in a table instead.  That's a byte of RAM per character it
+//  covers, so set COMMANDPARSER_TABLE_FIRST and COMMANDPARSER_TABLE_SIZE
+//  to just the characters your commands use, 'A' and 26 for capital
+//  letters.  Anything outside it falls back to the scan.
+#ifdef COMMANDPARSER_TABLE
+#ifndef COMMANDPARSER_TABLE_FIRST
+#define COMMANDPARSER_TABLE_FIRST ' '
+#endif
+#ifndef COMMANDPARSER_TABLE_SIZE
+#define COMMANDPARSER_TABLE_SIZE 96
+#endif
+#endif
+
+#define COMMANDPARSER_NO_ENTRY 0xFF
+
+#ifndef COMMANDPARSER_MAX_ARGS
+#define COMMANDPARSER_MAX_ARGS 4
+#endif
+
+//  Numbers that came after the command key, already parsed.
+struct CommandArgs {
+	int32_t values[COMMANDPARSER_MAX_ARGS];
+	uint8_t count;
+};
+
+//  Fills aArgs from the text at aText following aSchema, one character per
+//  argument:  'd' signed decimal, 'u' unsigned decimal, 'x' hex with or
+//  without 0x.  Arguments are split by commas or spaces and it stops at the
+//  end marker.  Returns false unless it gets exactly what the schema says.
+boolean parseCommandArgs(const char* aText, const char* aSchema, CommandArgs& aArgs);
+
+//  Define COMMANDPARSER_PROFILE to time every command.  Compiles out
+//  completely when it's not defined.
+#ifdef COMMANDPARSER_PROFILE
+struct CommandProfile {
+	uint16_t calls;
+	uint32_t totalMicros;
+	uint32_t maxMicros;
+
+	CommandProfile():calls(0), totalMicros(0), maxMicros(0){};
+};
+#endif
 
 typedef void (*commandFunc)(char*);
 
+//  Gets the context pointer the ExtendedCommand was made with.  One handler
+//  can then serve several joints or links.
+typedef void (*contextCommandFunc)(void*, char*);
+
+//  Gets its arguments already checked against the ExtendedCommand's schema.
+typedef void (*argCommandFunc)(char*, CommandArgs&);
+
+//  Binds a member function as a contextCommandFunc, no heap needed:
+//    ExtendedCommand('A', commandMember<Joint, &Joint::handleCommand>, &joint)
+template<class T, void (T::*M)(char*)>
+void commandMember(void* aContext, char* aCommand) {
+	(static_cast<T*>(aContext)->*M)(aCommand);
+}
+
+//  A plain one character command, all most sketches need.  Just the
+//  character and the function, same as it always was.
 struct Command {
 	char matchChar;
 	commandFunc function;
+#ifdef COMMANDPARSER_PROFILE
+	CommandProfile profile;
+#endif
 
 	Command(char m, commandFunc f):matchChar(m), function(f){};
 	void run(char* com){function(com);}
@@ -36,21 +101,131 @@ struct Command {
 	}
 };
 
+enum CommandKind {
+	CONTEXT_COMMAND,   // one character, contextCommandFunc with its context
+	ARG_COMMAND,       // one character, argCommandFunc with its schema
+	KEYWORD_COMMAND    // a whole keyword like "MS", commandFunc
+};
+
+//  Commands that need more than a function pointer go in a second array
+//  so the plain ones don't pay for it.  The context, schema and keyword
+//  share one spot.  With the table on, keywords sharing a first
+//  character are chained together longest first so the longest match wins.
+struct ExtendedCommand {
+	char matchChar;
+	uint8_t kind;
+#ifdef COMMANDPARSER_TABLE
+	uint8_t next;   // next keyword to try with the same first character, set by CommandParser
+#endif
+	union {
+		commandFunc function;
+		contextCommandFunc contextFunction;
+		argCommandFunc argFunction;
+	};
+	union {
+		void* context;          // CONTEXT_COMMAND
+		const char* schema;     // ARG_COMMAND
+		const char* keyword;    // KEYWORD_COMMAND
+	};
+#ifdef COMMANDPARSER_PROFILE
+	CommandProfile profile;
+#endif
+
+	ExtendedCommand(char m, contextCommandFunc f, void* c):matchChar(m), kind(CONTEXT_COMMAND), contextFunction(f), context(c){};
+	ExtendedCommand(char m, argCommandFunc f, const char* s):matchChar(m), kind(ARG_COMMAND), argFunction(f), schema(s){};
+	ExtendedCommand(const char* k, commandFunc f):matchChar(*k), kind(KEYWORD_COMMAND), function(f), keyword(k){};
+
+	uint8_t keyLength(){
+		return (kind == KEYWORD_COMMAND) ? strlen(keyword) : 1;
+	}
+
+	//  aKey is where the command key starts in com if it isn't the first
+	//  character.  Returns false if the arguments didn't fit the schema.
+	boolean run(char* com, char* aKey = NULL){
+		if (kind == ARG_COMMAND) {
+			CommandArgs args;
+			if (!parseCommandArgs(((aKey) ? aKey : com) + 1, schema, args)) {
+				return false;
+			}
+			argFunction(com, args);
+		} else if (kind == CONTEXT_COMMAND) {
+			contextFunction(context, com);
+		} else {
+			function(com);
+		}
+		return true;
+	}
+	boolean match(char* com){
+		if (kind == KEYWORD_COMMAND) {
+			for (const char* k = keyword; *k; k++, com++) {
+				if (*com != *k) {
+					return false;
+				}
+			}
+			return true;
+		}
+		return ((*com == matchChar) || (matchChar == '#' && *com >= '0' && *com <= '9'));
+	}
+};
+
+//  A keyword beats a one character command, the longest keyword wins and
+//  otherwise the first match wins, the plain commands ahead of the
+//  extended ones.  Indexes run through the plain commands then on into
+//  the extended ones, so the two together can't be more than 254.
 class CommandParser {
 
 private:
 	Command* commands;
 	uint8_t numCommands;
+	ExtendedCommand* extended;
+	uint8_t numExtended;
 
 	boolean hasStartMarker;
 
+#ifdef COMMANDPARSER_TABLE
+	uint8_t table[COMMANDPARSER_TABLE_SIZE];
+	boolean tableBuilt;
+
+	void chainKeyword(uint8_t);
+#endif
+	int findCommand(char*);
+	boolean runCommand(int, char*, char*);
+
+#ifdef COMMANDPARSER_PROFILE
+	uint16_t unmatched = 0;
+	uint16_t badArgs = 0;
+	char profileKey = 0;
+	Print* profileOut = NULL;
+
+	CommandProfile& profileFor(int);
+#endif
+
 
 public:
 
 	void parseCommandString(char* aCommand);
-
-	CommandParser(Command* c, uint8_t n):commands(c), numCommands(n), hasStartMarker(false){};
-	CommandParser(Command* c, uint8_t n, boolean m):commands(c), numCommands(n), hasStartMarker(m){};
+	int parseCommandFrames(char* aBuffer, int aLength);
+#ifdef COMMANDPARSER_TABLE
+	void buildTable();
+#endif
+
+#ifdef COMMANDPARSER_PROFILE
+	void setProfileQuery(char, Print*);
+	void dumpProfile(Print&);
+	void clearProfile();
+#endif
+
+	//  The table gets built on the first command, not here, in case the
+	//  commands array is a global that isn't set up yet.
+#ifdef COMMANDPARSER_TABLE
+	CommandParser(Command* c, uint8_t n):commands(c), numCommands(n), extended(NULL), numExtended(0), hasStartMarker(false), tableBuilt(false){};
+	CommandParser(Command* c, uint8_t n, boolean m):commands(c), numCommands(n), extended(NULL), numExtended(0), hasStartMarker(m), tableBuilt(false){};
+	CommandParser(Command* c, uint8_t n, ExtendedCommand* e, uint8_t ne, boolean m = false):commands(c), numCommands(n), extended(e), numExtended(ne), hasStartMarker(m), tableBuilt(false){};
+#else
+	CommandParser(Command* c, uint8_t n):commands(c), numCommands(n), extended(NULL), numExtended(0), hasStartMarker(false){};
+	CommandParser(Command* c, uint8_t n, boolean m):commands(c), numCommands(n), extended(NULL), numExtended(0), hasStartMarker(m){};
+	CommandParser(Command* c, uint8_t n, ExtendedCommand* e, uint8_t ne, boolean m = false):commands(c), numCommands(n), extended(e), numExtended(ne), hasStartMarker(m){};
+#endif
 };
 
 
@@ -23,56 +23,290 @@
 
 #include "RadioCommon.h"
 
-extern RH_RF95 radio;
-
 extern void handleRawRadio(uint8_t *p);
 extern void handleRadioCommand(char *p);
 
+// Only used in here, the sketch gets what's in RadioCommon.h
+static void radioSend(uint8_t*, uint8_t);
+static void flush(FlushCause);
+static TxSlot* holdingSlot();
+static boolean makeHoldingRoom();
+static void startTransmit(TxSlot&, TxPriority);
+static void recordSent(uint8_t);
+static void recordReceived(uint8_t);
+static void updateAirtimeModel();
+static void sendNextFragment();
+static ReassemblySlot* claimReassembly(uint8_t, uint8_t);
+static uint8_t buildLinkHeader(uint8_t*, boolean, uint8_t);
+static boolean handleLinkHeader(uint8_t*);
+static void handleLinkAck(uint8_t, uint8_t);
+static TxSlot* nextRetransmit(TxPriority&);
+static TxSlot* timedOut(TxSlot*, uint8_t, uint8_t, uint8_t, uint32_t);
+static boolean ackLane(TxSlot*, uint8_t&, uint8_t&, uint8_t&, uint8_t, uint8_t, uint8_t);
+static void popTxHead();
+static void popUrgentHead();
+static void blockingStep();
+static void rttSample(uint32_t);
+static void adrHeard(int16_t, int16_t);
+static int8_t adrStep(uint8_t);
+static uint16_t adrLost();
+static uint32_t adrHandshakeTimeout();
+static void adrMark();
+static void handleAdr();
+static void adrPropose(uint8_t);
+static void adrSwitch(uint8_t);
+static void adrHello();
+static void handleAdrString(char*);
+
+// The link processRadioBuffer and listenToRadio use, bound to the
+// handlers the sketch has always had to provide.
+RadioLink radioLink(handleRawRadio, handleRadioCommand);
+
 
-uint8_t holdingBuffer[HOLDING_BUFFER_SIZE];
+// The holding buffer is no longer its own array, it's the next free
+// slot in txQueue.  See holdingSlot().
 uint8_t holdingSize = 0;
+HoldingPolicy holdingPolicy = HOLD_BLOCK;
+uint16_t holdingDropCount = 0;
 
 uint32_t lastFlushTime;
 uint32_t maxFlushInterval = 10000;
 
 uint8_t resetPin = -1;
 
+TxSlot txQueue[TX_QUEUE_DEPTH];
+uint8_t txHead = 0;
+uint8_t txCount = 0;      // queued packets, including any waiting on an ack
+uint8_t txSent = 0;       // the ones at the head of the queue already sent, reliable mode only
+boolean txInFlight = false;
+uint32_t txDoneCount = 0;
+
+TxSlot urgentQueue[URGENT_QUEUE_DEPTH];
+uint8_t urgentHead = 0;
+uint8_t urgentCount = 0;    // including any waiting on an ack
+uint8_t urgentSent = 0;     // same as txSent for the urgent lane
+
+LaneLatency txLatency[NUMBER_OF_PRIORITIES];
+
+// The driver has no getters for these so keep track of what we set.
+// These are the defaults radio.init() leaves it at.
+uint8_t currentSF = 7;
+uint32_t currentBW = 125000;
+uint8_t currentCR = 5;
+uint8_t currentPreset = 0;   // ADR_NO_PRESET once someone sets B, S or C by hand
+
+// The duty cycle is only kept with the adaptive flush on or once D sets
+// one, otherwise low priority goes out as fast as the radio takes it.
+boolean adaptiveFlush = false;
+uint16_t dutyCyclePermille = 100;
+boolean dutyCycleSet = false;
+uint8_t blockingSends = 0;   // inside sendToRadio or waitForQueueSpace, they don't wait on the duty cycle
+uint32_t adaptiveFlushInterval = 0;
+uint32_t nextTxAllowed = 0;
+
+RadioStats radioStats;
+
+// sendLarge keeps a pointer to the caller's buffer until the last fragment
+// is out.  The message starts RADIO_LARGE_HEADROOM bytes into it.
+uint8_t *largeData = NULL;
+uint16_t largeLength = 0;
+uint8_t largeMsgId = 0;
+uint8_t largeNext = 0;
+uint8_t largeCount = 0;
+
+#if RADIO_REASSEMBLY_SLOTS > 0
+ReassemblySlot reassemblyPool[RADIO_REASSEMBLY_SLOTS];
+#endif
+
+boolean fecEnabled = false;
+ReedSolomon fec(RADIO_FEC_PARITY);
+
+boolean reliableMode = false;
+uint8_t txSeq = 0;
+boolean synPending = false;
+boolean rxSynced = false;     // we've heard sequenced packets and owe acks
+uint8_t rxNext = 0;
+uint8_t rxMask = 0;
+boolean ackPending = false;
+uint32_t ackDueAt = 0;
+uint32_t srtt8 = 0;           // smoothed round trip times 8, 0 until the first sample
+uint32_t rttvar4 = 0;         // mean deviation times 4
+uint8_t rtoBackoff = 0;
+uint8_t lastSentSeq = 0;      // the newest one on the air, the only one an ack times
+
+// Presets from fastest to most robust.  Sensitivity is from the SX1276
+// datasheet, the SNR is what that spreading factor can still pull a
+// packet out of (SF7 -7.5, SF9 -12.5, SF12 -20) rounded the safe way.
+#define ADR_STEPS 4
+const uint8_t adrLadder[ADR_STEPS] = {1, 0, 2, 3};
+const int16_t adrSensitivity[ADR_STEPS] = {-118, -123, -135, -137};
+const int8_t adrRequiredSnr[ADR_STEPS] = {-7, -7, -12, -20};
+
+AdrMode adrMode = ADR_OFF;
+uint8_t adrProposed = ADR_NO_PRESET;   // leader waiting on an accept for this
+uint32_t adrProposedAt = 0;
+uint8_t adrSwitchTo = ADR_NO_PRESET;   // change as soon as the radio is quiet
+boolean adrHandshake = false;          // that change was agreed on, not a fallback
+uint8_t adrRevertTo = ADR_NO_PRESET;   // go back here if the other end isn't heard after a handshake
+uint32_t adrLastHeard = 0;
+uint32_t adrLastEval = 0;
+uint8_t adrSamples = 0;
+int32_t adrRssi16 = 0;
+int32_t adrSnr16 = 0;
+uint16_t adrTriedMark = 0;    // packets both ways and the lost count at the last look
+uint16_t adrLostMark = 0;
+uint8_t adrLossPercent = 0;   // from the last look that had enough packets
+
 void initRadio(uint8_t aResetPin){
 	resetPin = aResetPin;
+	updateAirtimeModel();
 	pinMode(resetPin, OUTPUT);
 	digitalWrite(resetPin, HIGH);
 }
 
+// The wait loops call listenToRadio in reliable mode to hear acks, but
+// not if a handler called from in there is the one waiting
+boolean listening = false;
+
+// Packets come in here.  Outside of listenToRadio sendToRadio borrows
+// it for anything too big for a slot that needs room for the FEC bytes.
+uint8_t radioBuffer[MAX_MESSAGE_SIZE_RH];
+
 void listenToRadio() {
+	if (listening) {
+		return;
+	}
 	if (radio.available()) {
 
-		static uint8_t buf[MAX_MESSAGE_SIZE_RH] = { 0 };
-		memset(buf, 0, MAX_MESSAGE_SIZE_RH);
+		// no need to clear it, only len bytes ever get looked at
+		uint8_t *buf = radioBuffer;
 		uint8_t len = MAX_MESSAGE_SIZE_RH;
 
 		if (radio.recv(buf, &len)) {
-			processRadioBuffer(buf, len);
+			listening = true;
+			recordReceived(len);
+			uint8_t *p = buf;
+			boolean fresh = true;
+			// the marker is part of the codeword so a hit on it gets fixed too,
+			// nothing else we send starts with anything but '<'
+			if ((len > FEC_OVERHEAD) && ((buf[0] == RADIO_FEC_MARKER)
+					|| (fecEnabled && (buf[0] != START_OF_PACKET)))) {
+				int fixed = fec.decode(buf, len);
+				if (fixed < 0) {
+					radioStats.fecFailures++;
+					fresh = false;
+				} else {
+					radioStats.fecCorrected += fixed;
+				}
+				p++;
+				len -= FEC_OVERHEAD;
+			}
+			if (fresh && (len >= LINK_HEADER_SIZE) && (p[0] == START_OF_PACKET)
+					&& (p[1] == RADIO_SEQ_CODE) && (p[2] == LINK_HEADER_SIZE)) {
+				// false if we already had this one
+				fresh = handleLinkHeader(p);
+				p += LINK_HEADER_SIZE;
+				len -= LINK_HEADER_SIZE;
+			}
+			if (fresh && (len > 0)) {
+				processRadioBuffer(p, len);
+			}
+			listening = false;
 		}
 	}
 }
 
 void handleOutput(){
+	handleAdr();
+	handleTransmit();
 	if (holdingSize == 0) {
 		lastFlushTime = millis(); // don't start timer if we don't have anything to send.
 	}
-	if (millis() - lastFlushTime >= maxFlushInterval) {
-		flush();
+	uint32_t held = millis() - lastFlushTime;
+	if (held >= maxFlushInterval) {
+		flush(FLUSH_INTERVAL);
+	} else if (adaptiveFlush && (held >= adaptiveFlushInterval)
+			&& ((int32_t) (millis() - nextTxAllowed) >= 0)) {
+		flush(FLUSH_INTERVAL);
 	}
 }
 
 void processRadioBuffer(uint8_t *aBuf, uint8_t aLen) {
+	radioLink.process(aBuf, aLen);
+}
 
-	static boolean receiving = false;
-	static boolean receivingRaw = false;
-	static char commandBuffer[64];
-	static int index;
+RadioLink::RadioLink(radioRawFunc aRaw, radioCommandFunc aCommand) {
+	rawHandler = aRaw;
+	commandHandler = aCommand;
+	largeHandler = NULL;
+	reset();
+}
+
+//  Forget any partial command, like after a link drops.
+void RadioLink::reset() {
+	receiving = false;
+	receivingRaw = false;
+	index = 0;
+	commandBuffer[0] = 0;
+	fragSlot = NULL;
+	fragOffset = 0;
+}
+
+void RadioLink::setRawHandler(radioRawFunc aRaw) {
+	rawHandler = aRaw;
+}
+
+void RadioLink::setCommandHandler(radioCommandFunc aCommand) {
+	commandHandler = aCommand;
+}
+
+void RadioLink::setLargeHandler(radioLargeFunc aLarge) {
+	largeHandler = aLarge;
+}
+
+//  The fragment header is in commandBuffer, work out where the payload
+//  goes.  Anything that doesn't add up gets skipped over.
+void RadioLink::startFragment() {
+	uint8_t payload = (uint8_t) commandBuffer[2] - FRAG_HEADER_SIZE;
+	uint8_t fragIndex = commandBuffer[4];
+	uint8_t fragCount = commandBuffer[5];
+	fragSlot = NULL;
+	if (largeHandler == NULL) {
+		return;
+	}
+	fragOffset = fragIndex * FRAG_PAYLOAD_SIZE;
+	if ((fragCount == 0) || (fragCount > RADIO_MAX_FRAGMENTS) || (fragIndex >= fragCount)
+			|| ((fragIndex < fragCount - 1) && (payload != FRAG_PAYLOAD_SIZE))
+			|| (fragOffset + payload > RADIO_LARGE_MESSAGE_SIZE)) {
+		radioStats.fragmentDrops++;
+		return;
+	}
+	fragSlot = claimReassembly(commandBuffer[3], fragCount);
+	if (fragSlot == NULL) {
+		radioStats.fragmentDrops++;
+	}
+}
+
+void RadioLink::endFragment() {
+	if (fragSlot == NULL) {
+		return;
+	}
+	uint8_t fragIndex = commandBuffer[4];
+	fragSlot->received |= ((uint32_t) 1 << fragIndex);
+	fragSlot->lastHeard = millis();
+	if (fragIndex == fragSlot->fragCount - 1) {
+		fragSlot->length = fragOffset;
+	}
+	if (fragSlot->received == (0xFFFFFFFFUL >> (32 - fragSlot->fragCount))) {
+		fragSlot->active = false;
+		largeHandler(fragSlot->data, fragSlot->length);
+	}
+	fragSlot = NULL;
+}
+//  Commands can be split across packets, what's left over waits here
+//  for the next call.
+void RadioLink::process(uint8_t *aBuf, uint8_t aLen) {
 
-//	flushOnNextRaw = true;
 	uint8_t len = aLen;
 	if (len > MAX_MESSAGE_SIZE_RH) {
 		len = MAX_MESSAGE_SIZE_RH;
@@ -89,61 +323,466 @@ void processRadioBuffer(uint8_t *aBuf, uint8_t aLen) {
 			commandBuffer[0] = 0;
 		}
 		if (receiving) {
+			if (receivingRaw && (index >= FRAG_HEADER_SIZE) && (commandBuffer[1] == RADIO_FRAG_CODE)) {
+				// fragment payload goes straight into the pool a block at a time
+				uint8_t n = (uint8_t) commandBuffer[2] - index;
+				if (n > len - i) {
+					n = len - i;
+				}
+				if (fragSlot != NULL) {
+					memcpy(fragSlot->data + fragOffset, aBuf + i, n);
+				}
+				fragOffset += n;
+				index += n;
+				i += n - 1;
+				if (index >= (uint8_t) commandBuffer[2]) {
+					endFragment();
+					receivingRaw = false;
+					receiving = false;
+				}
+				continue;
+			}
 			commandBuffer[index++] = c;
 			if(receivingRaw){
-				if(index == (commandBuffer[2])){
-					// index 2 is the length of the raw command
+				// index 2 is the length of the raw command
+				// a length that won't fit would run off the end of commandBuffer
+				// except for fragments, they don't go in commandBuffer
+				uint8_t rawLength = commandBuffer[2];
+				boolean fragment = (commandBuffer[1] == RADIO_FRAG_CODE);
+				if ((index == 3) && ((fragment) ? (rawLength < FRAG_HEADER_SIZE) : (rawLength > RADIO_COMMAND_BUFFER_SIZE))) {
+					receivingRaw = false;
+					receiving = false;
+				} else if (fragment && (index == FRAG_HEADER_SIZE)) {
+					startFragment();
+					if (index >= rawLength) {
+						endFragment();
+						receivingRaw = false;
+						receiving = false;
+					}
+				} else if(index >= rawLength){
 					// so we've received a whole raw command
-					handleRawRadio((byte*)commandBuffer);
+					rawHandler((byte*)commandBuffer);
 					receivingRaw = false;
 					receiving = false;
 				}
 				continue; // skip the rest of the for loop, it's for ascii commands.
 			}
-			if((index == 2)&&((commandBuffer[1]>=0x11) && (commandBuffer[1]<=0x14))){
+			if((index == 2)&&(((commandBuffer[1]>=0x11) && (commandBuffer[1]<=0x14))
+					|| (commandBuffer[1] == RADIO_FRAG_CODE))){
 				receivingRaw = true;
 			}
 			commandBuffer[index] = 0;
-			if (index >= HOLDING_BUFFER_SIZE) {
+			if (index >= RADIO_COMMAND_BUFFER_SIZE - 1) {
+				// the terminator has to fit so the next character goes back a spot
 				index--;
 			}
 			if (c == END_OF_PACKET) {
 				receiving = false;
-				handleRadioCommand(commandBuffer);
+				commandHandler(commandBuffer);
 			}
 		}
 	}
 }
 
 
-void addToHolding(uint8_t *p, uint8_t aSize) {
-	if (HOLDING_BUFFER_SIZE - holdingSize <= aSize) {
-		//  Not enough room so clear the buffer now
+//  Returns false if the message got dropped by the holding policy, or
+//  was too big for a slot with FEC on and this got called from a radio handler.
+boolean addToHolding(uint8_t *p, uint8_t aSize) {
+	if (aSize > HOLDING_BUFFER_SIZE) {
+		// never going to fit, send it on its own behind what's held
 		flush();
+		return sendToRadio(p, aSize);
+	}
+	if (HOLDING_BUFFER_SIZE - holdingSize <= aSize) {
+		//  Not enough room so hand this buffer off and start the next
+		flush(FLUSH_SIZE);
+	}
+	if (holdingSize == 0) {
+		if (!makeHoldingRoom()) {
+			return false;
+		}
+		// latency for a batch counts from its first message
+		holdingSlot()->queuedAt = millis();
+		holdingSlot()->tries = 0;
+		holdingSlot()->sacked = false;
 	}
-	memcpy(holdingBuffer + holdingSize, p, aSize);
+	memcpy(holdingSlot()->data + holdingSize, p, aSize);
 	holdingSize += aSize;
+	return true;
 }
 
-void addToHolding(char *p) {
-	addToHolding((uint8_t*) p, strlen(p));
+boolean addToHolding(char *p) {
+	return addToHolding((uint8_t*) p, strlen(p));
 }
 
-void sendToRadio(char *p) {
-	sendToRadio((uint8_t*) p, strlen(p));
+boolean sendToRadio(char *p) {
+	return sendToRadio((uint8_t*) p, strlen(p));
 }
 
-void sendToRadio(uint8_t *p, uint8_t aSize) {
-	radio.send(p, aSize);
-	radio.waitPacketSent();
+//  This one still blocks until the packet is gone.  Anything already
+//  queued goes out first so things don't get sent out of order, but in
+//  reliable mode it doesn't wait on their acks.  With FEC on the parity
+//  needs somewhere to go, so it goes through a transmit slot, or if it's
+//  too big for one it's copied into radioBuffer.  That's in use from
+//  inside a radio handler so there those return false.  Too big for the
+//  FEC bytes to fit in a packet at all it goes without them.
+boolean sendToRadio(uint8_t *p, uint8_t aSize) {
+	boolean fecFits = (fecEnabled && (aSize + FEC_OVERHEAD <= MAX_MESSAGE_SIZE_RH));
+	if (fecFits && (aSize > TX_SLOT_SIZE) && listening) {
+		return false;
+	}
+	blockingSends++;
+	while (txBusy()) {
+		blockingStep();
+	}
+	if (fecFits && (aSize <= TX_SLOT_SIZE)) {
+		waitForQueueSpace();
+		queueToRadio(p, aSize);
+		while (txBusy()) {
+			blockingStep();
+		}
+	} else if (fecFits) {
+		// nothing gets received into it before the radio has its copy
+		memcpy(radioBuffer + 1, p, aSize);
+		radioSend(radioBuffer + 1, aSize);
+	} else {
+		radioSend(p, aSize);
+	}
+	waitForRadio();
+	blockingSends--;
+	return true;
+}
+
+//  One turn of a blocking wait.  The caller asked to wait on the radio,
+//  not the duty cycle, so while blockingSends is up handleTransmit lets
+//  low priority go without waiting out the off air time.
+static void blockingStep() {
+	waitForRadio();
+	if (reliableMode) {
+		listenToRadio();
+	}
+	handleTransmit();
+}
+
+//  Everything that goes on the air goes through here.  With FEC on the
+//  byte in front of aPacket is left open for the marker and there has to
+//  be room for the parity after it.
+static void radioSend(uint8_t *aPacket, uint8_t aLen) {
+	uint8_t *start = aPacket;
+	if (fecEnabled && (aLen + FEC_OVERHEAD <= MAX_MESSAGE_SIZE_RH)) {
+		start = aPacket - 1;
+		start[0] = RADIO_FEC_MARKER;
+		fec.encode(start, aLen + 1, aPacket + aLen);
+		aLen += FEC_OVERHEAD;
+	}
+	radio.send(start, aLen);
+	recordSent(aLen);
+
+	// acks and fragments pay for their air time too, whatever goes next
+	// stays off long enough to keep to the duty cycle
+	uint32_t airtime = loraTimeOnAir(aLen) / 1000;
+	nextTxAllowed = millis() + ((airtime * 1000) / dutyCyclePermille);
 }
 
 void flush() {
-	sendToRadio(holdingBuffer, holdingSize);
-	holdingSize = 0;
+	flush(FLUSH_OTHER);
+}
+
+//  Hands the holding buffer to the transmitter as it is, no copy.
+static void flush(FlushCause aCause) {
+	if (holdingSize > 0) {
+		radioStats.flushes[aCause]++;
+		holdingSlot()->length = holdingSize;
+		txCount++;
+		holdingSize = 0;
+		handleTransmit();
+	}
 	lastFlushTime = millis();
 }
 
+//  The holding buffer is whichever slot is next in line after the queued
+//  packets.  While holdingSize is non zero that slot is spoken for.
+//  NULL if every slot is queued up waiting for the air.
+static TxSlot* holdingSlot() {
+	if (txCount >= TX_QUEUE_DEPTH) {
+		return NULL;
+	}
+	return &txQueue[(txHead + txCount) % TX_QUEUE_DEPTH];
+}
+
+//  Gets a slot to start a new holding buffer in, or not, depending on the policy.
+static boolean makeHoldingRoom() {
+	handleTransmit();
+	if (txCount < TX_QUEUE_DEPTH) {
+		return true;
+	}
+	switch (holdingPolicy) {
+	case HOLD_DROP_NEW:
+		holdingDropCount++;
+		return false;
+	case HOLD_DROP_OLDEST:
+		// the one on the air is already out of the queue so this is the next
+		// one up, or in reliable mode the oldest one still waiting on an ack
+		popTxHead();
+		holdingDropCount++;
+		return true;
+	case HOLD_BLOCK:
+	default:
+		waitForQueueSpace();
+		return true;
+	}
+}
+
+void setHoldingPolicy(HoldingPolicy aPolicy) {
+	holdingPolicy = aPolicy;
+}
+
+//  Empty slots left besides the one being filled.  When this hits 0 the
+//  next flush leaves nowhere to put new messages and the policy kicks in.
+uint8_t holdingSlotsFree() {
+	handleTransmit();
+	uint8_t used = txCount + ((holdingSize > 0) ? 1 : 0);
+	return (used >= TX_QUEUE_DEPTH) ? 0 : TX_QUEUE_DEPTH - used;
+}
+
+boolean holdingBackpressure() {
+	return (holdingSlotsFree() == 0);
+}
+
+uint16_t holdingDrops() {
+	return holdingDropCount;
+}
+
+//  Puts the packet in the transmit queue and returns right away.  If
+//  there's something in the holding buffer this rides along with it,
+//  otherwise it gets a slot of its own.  Returns false if the queue is
+//  full or the packet won't fit in a slot.
+boolean queueToRadio(uint8_t *p, uint8_t aSize) {
+	if (aSize > TX_SLOT_SIZE) {
+		return false;
+	}
+	if (holdingSize > 0) {
+		if (TX_SLOT_SIZE - holdingSize >= aSize) {
+			memcpy(holdingSlot()->data + holdingSize, p, aSize);
+			holdingSize += aSize;
+			flush();
+			return true;
+		}
+		flush();
+	}
+	TxSlot *slot = holdingSlot();
+	if (slot == NULL) {
+		return false;
+	}
+	memcpy(slot->data, p, aSize);
+	slot->length = aSize;
+	slot->queuedAt = millis();
+	slot->tries = 0;
+	slot->sacked = false;
+	txCount++;
+	handleTransmit();
+	return true;
+}
+
+//  High priority skips the holding buffer and goes out ahead of all the
+//  low priority packets on the next chance the radio gets.  It only
+//  blocks if the urgent lane itself is full of packets not sent yet.  In
+//  reliable mode one full of packets waiting on acks gives up the oldest.
+boolean queueToRadio(uint8_t *p, uint8_t aSize, TxPriority aPriority) {
+	if (aPriority == PRIORITY_LOW) {
+		return queueToRadio(p, aSize);
+	}
+	if (aSize > TX_SLOT_SIZE) {
+		return false;
+	}
+	while ((urgentCount >= URGENT_QUEUE_DEPTH) && (urgentSent < urgentCount)) {
+		waitForRadio();
+		handleTransmit();
+	}
+	if (urgentCount >= URGENT_QUEUE_DEPTH) {
+		// the rest are waiting on acks, urgent doesn't wait on the peer
+		popUrgentHead();
+		radioStats.giveUps++;
+	}
+	TxSlot &slot = urgentQueue[(urgentHead + urgentCount) % URGENT_QUEUE_DEPTH];
+	memcpy(slot.data, p, aSize);
+	slot.length = aSize;
+	slot.queuedAt = millis();
+	slot.tries = 0;
+	slot.sacked = false;
+	urgentCount++;
+	handleTransmit();
+	return true;
+}
+
+boolean sendUrgent(uint8_t *p, uint8_t aSize) {
+	return queueToRadio(p, aSize, PRIORITY_HIGH);
+}
+
+boolean sendUrgent(char *p) {
+	return queueToRadio((uint8_t*) p, strlen(p), PRIORITY_HIGH);
+}
+
+boolean queueToRadio(char *p) {
+	return queueToRadio((uint8_t*) p, strlen(p));
+}
+
+//  Call from loop.  The radio's own interrupt puts it back to idle when
+//  a packet finishes, so all we have to do is notice and start the next one.
+void handleTransmit() {
+	if (radio.mode() == RADIO_DRIVER_CLASS::RHModeTx) {
+		return;
+	}
+	if (txInFlight) {
+		txInFlight = false;
+		txDoneCount++;
+	}
+	// only high priority and the blocking sends get to break the duty cycle
+	boolean lowAllowed = (blockingSends > 0) || !(adaptiveFlush || dutyCycleSet)
+			|| ((int32_t) (millis() - nextTxAllowed) >= 0);
+	TxPriority resendLane = PRIORITY_LOW;
+	TxSlot *resend = (reliableMode) ? nextRetransmit(resendLane) : NULL;
+	if ((resendLane == PRIORITY_LOW) && !lowAllowed) {
+		resend = NULL;
+	}
+	if (urgentSent < urgentCount) {
+		startTransmit(urgentQueue[(urgentHead + urgentSent) % URGENT_QUEUE_DEPTH], PRIORITY_HIGH);
+		if (reliableMode) {
+			// stays in its slot until it's acked
+			urgentSent++;
+		} else {
+			popUrgentHead();
+		}
+	} else if (resend != NULL) {
+		radioStats.retransmits++;
+		rtoBackoff = (rtoBackoff < RELIABLE_MAX_BACKOFF) ? rtoBackoff + 1 : RELIABLE_MAX_BACKOFF;
+		startTransmit(*resend, resendLane);
+	} else if (lowAllowed && (txSent < txCount)) {
+		if (!reliableMode) {
+			startTransmit(txQueue[txHead], PRIORITY_LOW);
+			txHead = (txHead + 1) % TX_QUEUE_DEPTH;
+			txCount--;
+		} else if (txSent < RELIABLE_WINDOW) {
+			// stays in its slot until it's acked
+			startTransmit(txQueue[(txHead + txSent) % TX_QUEUE_DEPTH], PRIORITY_LOW);
+			txSent++;
+		}
+	}
+	if (!txInFlight && lowAllowed && (largeData != NULL)) {
+		// large messages only get the air nothing else wants
+		sendNextFragment();
+	}
+	if (!txInFlight && ackPending && ((int32_t) (millis() - ackDueAt) >= 0)) {
+		// nothing came along to carry it
+		uint8_t header[FEC_OVERHEAD + LINK_HEADER_SIZE];
+		buildLinkHeader(header + 1, false, 0);
+		radioSend(header + 1, LINK_HEADER_SIZE);
+		txInFlight = true;
+	}
+}
+
+static void startTransmit(TxSlot &aSlot, TxPriority aPriority) {
+	boolean sequenced = reliableMode;
+	if (reliableMode || rxSynced || fecEnabled) {
+		// a link header in front or parity on the end means a copy
+		uint8_t packet[FEC_OVERHEAD + LINK_HEADER_SIZE + TX_SLOT_SIZE];
+		uint8_t pos = 0;
+		if (reliableMode || rxSynced) {
+			if (sequenced && (aSlot.tries == 0)) {
+				aSlot.seq = txSeq++;
+			}
+			pos = buildLinkHeader(packet + 1, sequenced, aSlot.seq);
+		}
+		memcpy(packet + 1 + pos, aSlot.data, aSlot.length);
+		radioSend(packet + 1, pos + aSlot.length);
+	} else {
+		// send copies into the radio's FIFO so the slot is free right after
+		radioSend(aSlot.data, aSlot.length);
+	}
+	txInFlight = true;
+
+	if (sequenced) {
+		aSlot.tries++;
+		aSlot.sentAt = millis();
+		lastSentSeq = aSlot.seq;
+		if (aSlot.tries > 1) {
+			// only the first try counts for latency
+			return;
+		}
+	}
+
+	uint32_t waited = millis() - aSlot.queuedAt;
+	LaneLatency &lat = txLatency[aPriority];
+	lat.packets++;
+	lat.totalMillis += waited;
+	if (waited > lat.maxMillis) {
+		lat.maxMillis = waited;
+	}
+}
+
+//  Blocks until there's at least one free slot.  In reliable mode slots
+//  only come free with acks, so once everything has been out it waits a
+//  timeout's worth for them.  A handler called from listenToRadio can't
+//  hear acks at all, so from there it doesn't wait.  Either way if
+//  nothing came free the oldest one gets given up on instead of waiting
+//  through all its retries.
+void waitForQueueSpace() {
+	blockingSends++;
+	while ((txCount >= TX_QUEUE_DEPTH) && txBusy()) {
+		blockingStep();
+	}
+	if ((txCount >= TX_QUEUE_DEPTH) && reliableMode && !listening) {
+		uint32_t start = millis();
+		uint32_t rto = reliableRto();
+		while ((txCount >= TX_QUEUE_DEPTH) && (millis() - start < rto)) {
+			blockingStep();
+		}
+	}
+	if (txCount >= TX_QUEUE_DEPTH) {
+		popTxHead();
+		radioStats.giveUps++;
+	}
+	blockingSends--;
+}
+
+//  Packets waiting, not counting the one on the air.  In reliable mode
+//  that includes the ones sent but not acked yet.
+uint8_t txQueueDepth() {
+	return txCount;
+}
+
+uint8_t urgentQueueDepth() {
+	return urgentCount;
+}
+
+//  True while the radio is on the air or there's a packet it hasn't sent
+//  yet, urgent or not.  Packets sent and waiting on an ack don't count, the waits that
+//  use this would otherwise sit through every retry when called from a
+//  handler, since the acks can't get in until it returns.
+boolean txBusy() {
+	handleTransmit();
+	if (txInFlight || (urgentSent < urgentCount)) {
+		return true;
+	}
+	return ((txSent < txCount) && (!reliableMode || (txSent < RELIABLE_WINDOW)));
+}
+
+//  Time from being queued to going on the air.  For low priority that
+//  includes the time spent in the holding buffer waiting for a flush.
+const LaneLatency& getLaneLatency(TxPriority aPriority) {
+	return txLatency[aPriority];
+}
+
+void clearLaneLatency() {
+	for (uint8_t i = 0; i < NUMBER_OF_PRIORITIES; i++) {
+		txLatency[i] = LaneLatency();
+	}
+}
+
+uint32_t txPacketsDone() {
+	return txDoneCount;
+}
+
 
 void handleConfigString(char *p) {
 	switch (p[2]) {
@@ -153,24 +792,7 @@ void handleConfigString(char *p) {
 		break;
 	}
 	case 'M': {
-		switch (p[3]) {
-		case '0':
-			radio.setModemConfig(RH_RF95::Bw125Cr45Sf128);
-			break;
-		case '1':
-			radio.setModemConfig(RH_RF95::Bw500Cr45Sf128);
-			break;
-		case '2':
-			radio.setModemConfig(RH_RF95::Bw31_25Cr48Sf512);
-			break;
-		case '3':
-			radio.setModemConfig(RH_RF95::Bw125Cr48Sf4096);
-			break;
-		default:
-			radio.setModemConfig(RH_RF95::Bw125Cr45Sf128);
-			break;
-
-		}
+		setModemPreset(p[3] - '0');
 		break;
 	}
 	case 'B': {
@@ -178,8 +800,12 @@ void handleConfigString(char *p) {
 		//  sketchy if below 62500 although I hear 31250 works ok sometimes
 		//  higher bandwidth is faster and more efficient but shorter range and more congestion
 		//  Each doubling of bandwidth is 3dB reduction in link budget
-		uint32_t entry = atoi((const char*) (p + 3));
+		//  (strtoul since atoi is only 16 bits on AVR and 125000 doesn't fit)
+		uint32_t entry = strtoul(p + 3, NULL, 10);
 		radio.setSignalBandwidth(entry);
+		currentBW = entry;
+		currentPreset = ADR_NO_PRESET;
+		updateAirtimeModel();
 		break;
 	}
 	case 'S': {
@@ -193,6 +819,9 @@ void handleConfigString(char *p) {
 			entry = 12;
 		}
 		radio.setSpreadingFactor(entry);
+		currentSF = entry;
+		currentPreset = ADR_NO_PRESET;
+		updateAirtimeModel();
 		break;
 	}
 	case 'C': {
@@ -205,6 +834,50 @@ void handleConfigString(char *p) {
 			entry = 8;
 		}
 		radio.setCodingRate4(entry);
+		currentCR = entry;
+		currentPreset = ADR_NO_PRESET;
+		updateAirtimeModel();
+		break;
+	}
+	case 'A': {
+		// adaptive flushing on (A1) or off (A0)
+		adaptiveFlush = (p[3] == '1');
+		break;
+	}
+	case 'D': {
+		// duty cycle target in tenths of a percent 1 - 1000, low priority
+		// traffic waits it out, high priority goes anyway.  D0 goes back
+		// to no limit unless the adaptive flush is on.
+		uint16_t entry = atoi((const char*) (p + 3));
+		if (entry < 1) {
+			dutyCycleSet = false;
+			break;
+		} else if (entry > 1000) {
+			entry = 1000;
+		}
+		dutyCyclePermille = entry;
+		dutyCycleSet = true;
+		updateAirtimeModel();
+		break;
+	}
+	case 'N': {
+		// adaptive data rate, settings and the handshake
+		handleAdrString(p);
+		break;
+	}
+	case 'L': {
+		// reliable mode on (L1) or off (L0)
+		setReliable(p[3] == '1');
+		break;
+	}
+	case 'F': {
+		// forward error correction on (F1) or off (F0), both ends need the same
+		setFec(p[3] == '1');
+		break;
+	}
+	case 'Q': {
+		// send back the link statistics
+		sendRadioStats();
 		break;
 	}
 	case 'R': {
@@ -219,6 +892,799 @@ void handleConfigString(char *p) {
 
 
 
+//  Every place that has to wait on the radio goes through here so we
+//  know how much time the main loop lost to it.
+void waitForRadio() {
+	uint32_t startTime = micros();
+	radio.waitPacketSent();
+	radioStats.blockedMicros += micros() - startTime;
+}
+
+static void recordSent(uint8_t aLen) {
+	radioStats.packetsSent++;
+	radioStats.bytesSent += aLen;
+	radioStats.airtimeMicros += loraTimeOnAir(aLen);
+}
+
+//  Averages are kept times 16 and move an eighth of the way each packet.
+static void recordReceived(uint8_t aLen) {
+	radioStats.packetsReceived++;
+	radioStats.bytesReceived += aLen;
+	radioStats.lastRssi = radio.lastRssi();
+	radioStats.lastSnr = radio.lastSNR();
+	if (radioStats.packetsReceived == 1) {
+		radioStats.avgRssi16 = radioStats.lastRssi * 16;
+		radioStats.avgSnr16 = radioStats.lastSnr * 16;
+	} else {
+		radioStats.avgRssi16 += ((radioStats.lastRssi * 16) - radioStats.avgRssi16) / 8;
+		radioStats.avgSnr16 += ((radioStats.lastSnr * 16) - radioStats.avgSnr16) / 8;
+	}
+	adrHeard(radioStats.lastRssi, radioStats.lastSnr);
+}
+
+const RadioStats& getRadioStats() {
+	return radioStats;
+}
+
+void clearRadioStats() {
+	radioStats = RadioStats();
+	radioStats.since = millis();
+	adrMark();
+}
+
+//  Time on air as tenths of a percent of the time since the stats were cleared.
+uint16_t channelUtilization() {
+	uint32_t elapsed = millis() - radioStats.since;
+	if (elapsed == 0) {
+		return 0;
+	}
+	uint32_t util = (radioStats.airtimeMicros / elapsed);  // micros per milli is already per mille
+	return (util > 1000) ? 1000 : util;
+}
+
+//  Answers a query with two frames, link quality then throughput:
+//  <RQL,lastRssi,avgRssi,lastSnr,avgSnr,packetsRx,packetsTx>
+//  <RQT,bytesRx,bytesTx,sizeFlushes,intervalFlushes,blockedMs,utilization>
+//  All in one frame could run past 100 characters with the counters big,
+//  more than a holding buffer takes, so it's two.  Both go through the
+//  holding buffer in order, sharing a packet when they fit, and get
+//  flushed so the answer doesn't wait on the interval.
+void sendRadioStats() {
+	char buf[HOLDING_BUFFER_SIZE];
+	snprintf(buf, sizeof(buf), "<RQL,%d,%d,%d,%d,%lu,%lu>",
+			radioStats.lastRssi, (int) (radioStats.avgRssi16 / 16),
+			radioStats.lastSnr, (int) (radioStats.avgSnr16 / 16),
+			(unsigned long) radioStats.packetsReceived,
+			(unsigned long) radioStats.packetsSent);
+	addToHolding(buf);
+	snprintf(buf, sizeof(buf), "<RQT,%lu,%lu,%u,%u,%lu,%u>",
+			(unsigned long) radioStats.bytesReceived,
+			(unsigned long) radioStats.bytesSent,
+			radioStats.flushes[FLUSH_SIZE], radioStats.flushes[FLUSH_INTERVAL],
+			(unsigned long) (radioStats.blockedMicros / 1000),
+			channelUtilization());
+	addToHolding(buf);
+	flush();
+}
+
+void setModemPreset(uint8_t aPreset) {
+	currentPreset = (aPreset <= 3) ? aPreset : 0;
+	switch (aPreset) {
+	case 1:
+		radio.setModemConfig(RADIO_DRIVER_CLASS::Bw500Cr45Sf128);
+		currentBW = 500000;
+		currentCR = 5;
+		currentSF = 7;
+		break;
+	case 2:
+		radio.setModemConfig(RADIO_DRIVER_CLASS::Bw31_25Cr48Sf512);
+		currentBW = 31250;
+		currentCR = 8;
+		currentSF = 9;
+		break;
+	case 3:
+		radio.setModemConfig(RADIO_DRIVER_CLASS::Bw125Cr48Sf4096);
+		currentBW = 125000;
+		currentCR = 8;
+		currentSF = 12;
+		break;
+	case 0:
+	default:
+		radio.setModemConfig(RADIO_DRIVER_CLASS::Bw125Cr45Sf128);
+		currentBW = 125000;
+		currentCR = 5;
+		currentSF = 7;
+		break;
+	}
+	updateAirtimeModel();
+}
+
+//  Time on air in microseconds for a packet of aLen bytes with the current
+//  settings.  Semtech's formula from the SX1276 datasheet with what
+//  RadioHead uses:  8 symbol preamble, explicit header, CRC on unless FEC
+//  turned it off, and the 4 byte RadioHead header on top of our payload.
+uint32_t loraTimeOnAir(uint8_t aLen) {
+	uint32_t symbolMicros = ((uint32_t) 1000000 << currentSF) / currentBW;
+	// Low data rate optimize.  The presets have it in their register values
+	// and only Bw125Cr48Sf4096 turns it on, Bw31_25Cr48Sf512 leaves it off
+	// even though its symbols are over 16ms.  Set by hand, RadioHead turns
+	// it on when a symbol is longer than 16ms.
+	uint8_t lowRate;
+	if (currentPreset == ADR_NO_PRESET) {
+		lowRate = (symbolMicros > 16000) ? 1 : 0;
+	} else {
+		lowRate = (currentPreset == 3) ? 1 : 0;
+	}
+
+	int32_t bits = (8 * ((int32_t) aLen + RADIO_HEADER_LEN)) - (4 * currentSF) + 28 + ((fecEnabled) ? 0 : 16);
+	int32_t perBlock = 4 * (currentSF - (2 * lowRate));
+	int32_t payloadSymbols = 8;
+	if (bits > 0) {
+		payloadSymbols += ((bits + perBlock - 1) / perBlock) * currentCR;
+	}
+	// preamble is 8 + 4.25 symbols, so count in quarter symbols
+	uint32_t quarterSymbols = 49 + (4 * payloadSymbols);
+	return (quarterSymbols * symbolMicros) / 4;
+}
+
+//  The adaptive interval is how often full packets could go out and still
+//  keep to the duty cycle.  Waiting at least that long packs as much as
+//  possible behind each preamble.  maxFlushInterval still caps the latency.
+static void updateAirtimeModel() {
+	uint32_t fullPacket = loraTimeOnAir(HOLDING_BUFFER_SIZE) / 1000;
+	adaptiveFlushInterval = (fullPacket * 1000) / dutyCyclePermille;
+	// round trips measured on the old settings don't mean anything now
+	srtt8 = 0;
+	rttvar4 = 0;
+}
+
+uint32_t getAdaptiveFlushInterval() {
+	return adaptiveFlushInterval;
+}
+
+uint32_t getMaxFlushInterval() {
+	return maxFlushInterval;
+}
+
+uint16_t getDutyCycle() {
+	return dutyCyclePermille;
+}
+
+boolean getAdaptiveFlush() {
+	return adaptiveFlush;
+}
+
+uint8_t getSpreadingFactor() {
+	return currentSF;
+}
+
+uint32_t getBandwidth() {
+	return currentBW;
+}
+
+uint8_t getCodingRate() {
+	return currentCR;
+}
+
+uint8_t getModemPreset() {
+	return currentPreset;
+}
+
+//  The CRC flag goes out in each packet's LoRa header and the receiving
+//  radio drops any packet that has it set and fails it, exactly the ones
+//  FEC could fix.  So with FEC on this end sends without it, which is
+//  what lets the peer's radio hand up damaged packets from us.  Whether
+//  damaged packets reach this end is up to the peer's setting.  An end
+//  with FEC off still decodes FEC packets by their marker.
+void setFec(boolean aOn) {
+	fecEnabled = aOn;
+	radio.setPayloadCRC(!aOn);
+	updateAirtimeModel();
+}
+
+boolean getFec() {
+	return fecEnabled;
+}
+
+//  Sends a message in full size fragments from handleTransmit, in between
+//  everything else, and returns right away.  aBuffer is laid out like
+//  RADIO_LARGE_BUFFER_SIZE says and has to stay put until largeBusy() goes
+//  false.  Only one at a time.  Fragments go unnumbered even in reliable
+//  mode, a lost one times out the message.
+boolean sendLarge(uint8_t *aBuffer, uint16_t aLength) {
+	if ((largeData != NULL) || (aLength == 0) || (aLength > RADIO_LARGE_MESSAGE_SIZE)) {
+		return false;
+	}
+	largeData = aBuffer;
+	largeLength = aLength;
+	largeNext = 0;
+	largeCount = (aLength + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+	handleTransmit();
+	return true;
+}
+
+boolean largeBusy() {
+	handleTransmit();
+	return (largeData != NULL);
+}
+
+//  The headers go in right in front of the chunk, over the end of the one
+//  before it or the headroom, and the parity over the start of the next
+//  one.  Whatever was there goes back once the radio has its copy.
+static void sendNextFragment() {
+	uint16_t offset = largeNext * FRAG_PAYLOAD_SIZE;
+	uint8_t chunk = (largeLength - offset > FRAG_PAYLOAD_SIZE) ? FRAG_PAYLOAD_SIZE : largeLength - offset;
+	uint8_t *payload = largeData + RADIO_LARGE_HEADROOM + offset;
+	uint8_t headers = FRAG_HEADER_SIZE;
+	if (reliableMode || rxSynced) {
+		headers += LINK_HEADER_SIZE;
+	}
+	uint8_t *packet = payload - headers - 1;   // one more for the FEC marker
+
+	uint8_t savedHead[RADIO_LARGE_HEADROOM];
+	uint8_t savedTail[RADIO_FEC_PARITY];
+	memcpy(savedHead, packet, headers + 1);
+	memcpy(savedTail, payload + chunk, RADIO_FEC_PARITY);
+
+	if (reliableMode || rxSynced) {
+		buildLinkHeader(packet + 1, false, 0);
+	}
+	uint8_t *frag = payload - FRAG_HEADER_SIZE;
+	frag[0] = START_OF_PACKET;
+	frag[1] = RADIO_FRAG_CODE;
+	frag[2] = FRAG_HEADER_SIZE + chunk;
+	frag[3] = largeMsgId;
+	frag[4] = largeNext;
+	frag[5] = largeCount;
+	radioSend(packet + 1, headers + chunk);
+	txInFlight = true;
+
+	memcpy(packet, savedHead, headers + 1);
+	memcpy(payload + chunk, savedTail, RADIO_FEC_PARITY);
+	if (++largeNext >= largeCount) {
+		largeData = NULL;
+		largeMsgId++;
+	}
+}
+
+//  The slot already collecting aMsgId, or a free one.  Slots that have
+//  gone quiet too long are timed out here when someone needs one.
+static ReassemblySlot* claimReassembly(uint8_t aMsgId, uint8_t aFragCount) {
+#if RADIO_REASSEMBLY_SLOTS > 0
+	uint32_t now = millis();
+	uint32_t timeout = (3 * loraTimeOnAir(MAX_MESSAGE_SIZE_RH)) / 1000;
+	if (timeout < RADIO_REASSEMBLY_TIMEOUT) {
+		timeout = RADIO_REASSEMBLY_TIMEOUT;
+	}
+	ReassemblySlot *unused = NULL;
+	for (uint8_t i = 0; i < RADIO_REASSEMBLY_SLOTS; i++) {
+		ReassemblySlot &slot = reassemblyPool[i];
+		if (slot.active && (now - slot.lastHeard >= timeout)) {
+			slot.active = false;
+			radioStats.reassemblyTimeouts++;
+		}
+		if (slot.active && (slot.msgId == aMsgId) && (slot.fragCount == aFragCount)) {
+			return &slot;
+		}
+		if (!slot.active && (unused == NULL)) {
+			unused = &slot;
+		}
+	}
+	if (unused != NULL) {
+		unused->active = true;
+		unused->msgId = aMsgId;
+		unused->fragCount = aFragCount;
+		unused->received = 0;
+		unused->length = 0;
+		unused->lastHeard = now;
+	}
+	return unused;
+#else
+	return NULL;
+#endif
+}
+
+//  Both ends need it on to get retransmits, but an end with it off still
+//  acks and throws out duplicates once it hears sequenced packets.
+//  Turning it on starts the numbering over and tells the peer to follow.
+void setReliable(boolean aOn) {
+	if (!aOn) {
+		// anything sent is as good as it's going to get
+		while (txSent > 0) {
+			popTxHead();
+		}
+		while (urgentSent > 0) {
+			popUrgentHead();
+		}
+	}
+	reliableMode = aOn;
+	txSeq = 0;
+	synPending = aOn;
+	rtoBackoff = 0;
+}
+
+boolean getReliable() {
+	return reliableMode;
+}
+
+//  Fills in the 7 byte link header, returns its size.  Anything that goes
+//  out with one carries the ack so there's no need to send it alone.
+static uint8_t buildLinkHeader(uint8_t *aBuf, boolean aSequenced, uint8_t aSeq) {
+	uint8_t flags = 0;
+	if (aSequenced) {
+		flags |= LINK_SEQ_FLAG;
+		if (synPending) {
+			flags |= LINK_SYN_FLAG;
+		}
+	}
+	if (rxSynced) {
+		flags |= LINK_ACK_FLAG;
+		ackPending = false;
+	}
+	aBuf[0] = START_OF_PACKET;
+	aBuf[1] = RADIO_SEQ_CODE;
+	aBuf[2] = LINK_HEADER_SIZE;
+	aBuf[3] = flags;
+	aBuf[4] = aSeq;
+	aBuf[5] = rxNext;
+	aBuf[6] = rxMask;
+	return LINK_HEADER_SIZE;
+}
+
+//  Returns false if the packet is a duplicate and should be thrown out.
+//  Packets are handed up as they come, out of order ones don't wait for
+//  the gap to fill, there isn't the RAM to hold them.
+static boolean handleLinkHeader(uint8_t *aHeader) {
+	uint8_t flags = aHeader[3];
+	// the peer's still there, so what's going missing is down to the channel
+	// and waiting longer won't help, backing off is for when it goes quiet
+	rtoBackoff = 0;
+	if (flags & LINK_ACK_FLAG) {
+		handleLinkAck(aHeader[5], aHeader[6]);
+	}
+	if (!(flags & LINK_SEQ_FLAG)) {
+		return true;
+	}
+	uint8_t seq = aHeader[4];
+	if (!ackPending) {
+		ackPending = true;
+		ackDueAt = millis() + RELIABLE_ACK_DELAY;
+	}
+	uint8_t ahead = seq - rxNext;
+	if (!rxSynced || ((flags & LINK_SYN_FLAG) && (ahead > 8))) {
+		rxSynced = true;
+		rxNext = seq;
+		rxMask = 0;
+		ahead = 0;
+	}
+	if (ahead < 128) {
+		// anything between the newest one we have and this is missing, for now
+		uint8_t heard = 0;
+		if (rxMask) {
+			heard = 2;
+			for (uint8_t m = rxMask >> 1; m; m >>= 1) {
+				heard++;
+			}
+		}
+		if (ahead > heard) {
+			radioStats.seqGaps += ahead - heard;
+		}
+	}
+	if (ahead == 0) {
+		// the one we were waiting on, move up past anything already here
+		rxNext++;
+		while (rxMask & 1) {
+			rxMask >>= 1;
+			rxNext++;
+		}
+		rxMask >>= 1;
+		return true;
+	}
+	if (ahead <= 8) {
+		uint8_t bit = 1 << (ahead - 1);
+		if (rxMask & bit) {
+			radioStats.duplicates++;
+			return false;
+		}
+		rxMask |= bit;
+		return true;
+	}
+	if (ahead >= 128) {
+		// behind rxNext, an old one sent again
+		radioStats.duplicates++;
+		return false;
+	}
+	// too far ahead to track, the peer gave up on something
+	rxNext = seq + 1;
+	rxMask = 0;
+	return true;
+}
+
+//  Both lanes are numbered from the same count, each one's sent packets
+//  are in order within it.
+static void handleLinkAck(uint8_t aAck, uint8_t aSack) {
+	boolean progress = ackLane(txQueue, txHead, txCount, txSent, TX_QUEUE_DEPTH, aAck, aSack);
+	if (ackLane(urgentQueue, urgentHead, urgentCount, urgentSent, URGENT_QUEUE_DEPTH, aAck, aSack)) {
+		progress = true;
+	}
+	if (progress) {
+		synPending = false;
+	}
+}
+
+//  Takes what's acked off the front of one lane and marks what's sacked.
+//  Returns true if anything got there.
+static boolean ackLane(TxSlot *aQueue, uint8_t &aHead, uint8_t &aCount, uint8_t &aSent, uint8_t aDepth,
+		uint8_t aAck, uint8_t aSack) {
+	boolean progress = false;
+	while (aSent > 0) {
+		TxSlot &slot = aQueue[aHead];
+		uint8_t behind = aAck - slot.seq;
+		if ((behind == 0) || (behind >= 128)) {
+			break;
+		}
+		if ((slot.tries == 1) && (slot.seq == lastSentSeq)) {
+			// Karn, a resent packet's ack could be for either try.  And
+			// only the newest one, an older one's ack could have been
+			// lost and this is the peer acking something sent since.
+			rttSample(millis() - slot.sentAt);
+		}
+		aHead = (aHead + 1) % aDepth;
+		aCount--;
+		aSent--;
+		progress = true;
+	}
+	for (uint8_t i = 0; i < aSent; i++) {
+		TxSlot &slot = aQueue[(aHead + i) % aDepth];
+		uint8_t bit = slot.seq - aAck - 1;
+		if ((bit < 8) && (aSack & (1 << bit)) && !slot.sacked) {
+			slot.sacked = true;
+			if ((slot.tries == 1) && (slot.seq == lastSentSeq)) {
+				rttSample(millis() - slot.sentAt);
+			}
+			// the link is working, it's just the one in front that's missing
+			progress = true;
+			for (uint8_t j = 0; j < i; j++) {
+				TxSlot &older = aQueue[(aHead + j) % aDepth];
+				if (!older.sacked && ((int32_t) (slot.sentAt - older.sentAt) > 0)) {
+					// went out first and still isn't there, don't wait out its timer
+					older.sentAt = millis() - RELIABLE_MAX_RTO;
+				}
+			}
+		}
+	}
+	return progress;
+}
+
+//  The oldest sent packet that's timed out, urgent ones first, and which
+//  lane it's in.  Ones that have had all their tries get given up on.
+static TxSlot* nextRetransmit(TxPriority &aLane) {
+	uint32_t rto = reliableRto();
+	TxSlot *found = timedOut(urgentQueue, urgentHead, urgentSent, URGENT_QUEUE_DEPTH, rto);
+	TxSlot *low = timedOut(txQueue, txHead, txSent, TX_QUEUE_DEPTH, rto);
+	aLane = PRIORITY_HIGH;
+	if (found == NULL) {
+		found = low;
+		aLane = PRIORITY_LOW;
+	}
+	// settled ones at the head are done with, anything missing before
+	// them was already given up on
+	while ((txSent > 0) && txQueue[txHead].sacked) {
+		popTxHead();
+	}
+	while ((urgentSent > 0) && urgentQueue[urgentHead].sacked) {
+		popUrgentHead();
+	}
+	return found;
+}
+
+static TxSlot* timedOut(TxSlot *aQueue, uint8_t aHead, uint8_t aSent, uint8_t aDepth, uint32_t aRto) {
+	uint32_t now = millis();
+	TxSlot *found = NULL;
+	for (uint8_t i = 0; i < aSent; i++) {
+		TxSlot &slot = aQueue[(aHead + i) % aDepth];
+		if (slot.sacked || (now - slot.sentAt < aRto)) {
+			continue;
+		}
+		if (slot.tries >= RELIABLE_MAX_TRIES) {
+			slot.sacked = true;
+			radioStats.giveUps++;
+		} else if (found == NULL) {
+			found = &slot;
+		}
+	}
+	return found;
+}
+
+static void popTxHead() {
+	txHead = (txHead + 1) % TX_QUEUE_DEPTH;
+	txCount--;
+	if (txSent > 0) {
+		txSent--;
+	}
+}
+
+static void popUrgentHead() {
+	urgentHead = (urgentHead + 1) % URGENT_QUEUE_DEPTH;
+	urgentCount--;
+	if (urgentSent > 0) {
+		urgentSent--;
+	}
+}
+
+//  Jacobson's smoothing in integers, srtt moves an eighth of the way and
+//  the deviation a quarter.
+static void rttSample(uint32_t aRtt) {
+	if (srtt8 == 0) {
+		srtt8 = aRtt << 3;
+		rttvar4 = aRtt << 1;
+	} else {
+		int32_t delta = (int32_t) aRtt - (int32_t) (srtt8 >> 3);
+		srtt8 += delta;
+		if (delta < 0) {
+			delta = -delta;
+		}
+		rttvar4 += delta - (int32_t) (rttvar4 >> 2);
+	}
+}
+
+//  srtt + 4 * rttvar, doubled for each retransmit since the peer was last
+//  heard from.  Until there's a sample it guesses a full packet each way
+//  plus the ack delay.
+uint32_t reliableRto() {
+	uint32_t rto;
+	if (srtt8 == 0) {
+		rto = (2 * loraTimeOnAir(LINK_HEADER_SIZE + TX_SLOT_SIZE)) / 1000 + RELIABLE_ACK_DELAY;
+	} else {
+		rto = (srtt8 >> 3) + rttvar4;
+	}
+	rto <<= rtoBackoff;
+	if (rto < RELIABLE_MIN_RTO) {
+		rto = RELIABLE_MIN_RTO;
+	} else if (rto > RELIABLE_MAX_RTO) {
+		rto = RELIABLE_MAX_RTO;
+	}
+	return rto;
+}
+
+//  Where a preset sits on the ladder, -1 if it isn't one.
+static int8_t adrStep(uint8_t aPreset) {
+	for (int8_t i = 0; i < ADR_STEPS; i++) {
+		if (adrLadder[i] == aPreset) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void setAdrMode(AdrMode aMode) {
+	adrMode = aMode;
+	adrProposed = ADR_NO_PRESET;
+	adrSwitchTo = ADR_NO_PRESET;
+	adrHandshake = false;
+	adrRevertTo = ADR_NO_PRESET;
+	adrSamples = 0;
+	adrLossPercent = 0;
+	adrLastHeard = millis();
+	adrLastEval = adrLastHeard;
+	adrMark();
+}
+
+AdrMode getAdrMode() {
+	return adrMode;
+}
+
+//  Averages only count packets heard on the current preset, SNR moves
+//  with the bandwidth so the old numbers don't mean anything after a switch.
+static void adrHeard(int16_t aRssi, int16_t aSnr) {
+	adrLastHeard = millis();
+	if (adrSamples == 0) {
+		adrRssi16 = aRssi * 16;
+		adrSnr16 = aSnr * 16;
+	} else {
+		adrRssi16 += ((aRssi * 16) - adrRssi16) / 8;
+		adrSnr16 += ((aSnr * 16) - adrSnr16) / 8;
+	}
+	if (adrSamples < 255) {
+		adrSamples++;
+	}
+}
+
+//  What reliable mode saw go missing: our resends and give ups, and the
+//  numbers the peer skipped.  Only ever looked at as a difference.
+static uint16_t adrLost() {
+	return radioStats.retransmits + radioStats.giveUps + radioStats.seqGaps;
+}
+
+//  Three full packet times on the current settings, or ADR_HANDSHAKE_TIMEOUT
+//  if that's longer.  The slow presets take most of a second each way.
+static uint32_t adrHandshakeTimeout() {
+	uint32_t timeout = (3 * loraTimeOnAir(TX_SLOT_SIZE)) / 1000;
+	return (timeout < ADR_HANDSHAKE_TIMEOUT) ? ADR_HANDSHAKE_TIMEOUT : timeout;
+}
+
+static void adrMark() {
+	adrTriedMark = radioStats.packetsSent + radioStats.packetsReceived;
+	adrLostMark = adrLost();
+}
+
+//  Call from loop, handleOutput already does.  The leader judges the link
+//  every so often and asks the follower to change.  After a handshake
+//  either end goes back if it doesn't hear the other one on the new
+//  preset.  Either end falls back to the most robust preset if it stops
+//  hearing the other one, so if it all goes wrong they both end up there
+//  and start over.
+static void handleAdr() {
+	if (adrMode == ADR_OFF) {
+		return;
+	}
+	if (adrSwitchTo != ADR_NO_PRESET) {
+		// changing the modem mid packet would garble it, and the follower
+		// has to get its accept out on the old settings first
+		if ((urgentSent >= urgentCount) && (radio.mode() != RADIO_DRIVER_CLASS::RHModeTx)) {
+			adrSwitch(adrSwitchTo);
+		}
+		return;
+	}
+	uint32_t now = millis();
+	uint32_t quiet = now - adrLastHeard;
+	if (adrRevertTo != ADR_NO_PRESET) {
+		if (adrSamples > 0) {
+			// heard the other end on the new one, it stays
+			adrRevertTo = ADR_NO_PRESET;
+		} else if (quiet >= adrHandshakeTimeout()) {
+			adrSwitchTo = adrRevertTo;
+			adrRevertTo = ADR_NO_PRESET;
+			return;
+		}
+	}
+	if (quiet >= ADR_FALLBACK_TIMEOUT) {
+		if (currentPreset != adrLadder[ADR_STEPS - 1]) {
+			adrProposed = ADR_NO_PRESET;
+			adrHandshake = false;
+			adrSwitchTo = adrLadder[ADR_STEPS - 1];
+		}
+		return;
+	}
+	if (adrMode != ADR_LEADER) {
+		return;
+	}
+	if (adrProposed != ADR_NO_PRESET) {
+		if (now - adrProposedAt >= adrHandshakeTimeout()) {
+			// never heard back, stay put and try again later
+			adrProposed = ADR_NO_PRESET;
+		}
+		return;
+	}
+	if (now - adrLastEval < ADR_EVAL_INTERVAL) {
+		return;
+	}
+	adrLastEval = now;
+	// a couple of collisions in a quiet spell isn't a bad link, so the
+	// loss keeps adding up across looks until there's enough to go on
+	uint16_t tried = (uint16_t) (radioStats.packetsSent + radioStats.packetsReceived) - adrTriedMark;
+	boolean lossy = false;
+	if (tried >= ADR_LOSS_SAMPLES) {
+		uint16_t lost = adrLost() - adrLostMark;
+		adrLossPercent = (lost >= tried) ? 100 : ((uint32_t) lost * 100) / tried;
+		lossy = (adrLossPercent >= ADR_DOWN_LOSS);
+		adrMark();
+	}
+
+	int8_t step = adrStep(currentPreset);
+	if (step < 0) {
+		// modem was set by hand, leave it alone
+		return;
+	}
+	if (quiet >= ADR_LOSS_TIMEOUT) {
+		if (step < ADR_STEPS - 1) {
+			adrPropose(adrLadder[step + 1]);
+		}
+		return;
+	}
+	if (adrSamples < ADR_MIN_SAMPLES) {
+		return;
+	}
+	// whichever runs out first, signal over the noise floor or SNR
+	int16_t margin = (adrRssi16 / 16) - adrSensitivity[step];
+	int16_t snrMargin = (adrSnr16 / 16) - adrRequiredSnr[step];
+	if (snrMargin < margin) {
+		margin = snrMargin;
+	}
+	// packets going missing with the signal not far over the floor means
+	// fading or noise the average doesn't show, a slower preset helps there.
+	// With plenty of margin it's collisions or interference and it wouldn't.
+	if ((margin < ADR_DOWN_MARGIN) || (lossy && (margin < ADR_UP_MARGIN))) {
+		if (step < ADR_STEPS - 1) {
+			adrPropose(adrLadder[step + 1]);
+		}
+	} else if ((step > 0) && (adrLossPercent < ADR_DOWN_LOSS / 2)) {
+		// the faster preset gives up the difference in sensitivity
+		int16_t fasterMargin = margin - (adrSensitivity[step - 1] - adrSensitivity[step]);
+		if (fasterMargin >= ADR_UP_MARGIN) {
+			adrPropose(adrLadder[step - 1]);
+		}
+	}
+}
+
+static void adrPropose(uint8_t aPreset) {
+	char buf[10];
+	snprintf(buf, sizeof(buf), "<%cNP%d>", RADIO_CONFIG_CHAR, aPreset);
+	adrProposed = aPreset;
+	adrProposedAt = millis();
+	sendUrgent(buf);
+}
+
+static void adrSwitch(uint8_t aPreset) {
+	adrRevertTo = (adrHandshake) ? currentPreset : ADR_NO_PRESET;
+	setModemPreset(aPreset);
+	adrSwitchTo = ADR_NO_PRESET;
+	adrProposed = ADR_NO_PRESET;
+	adrSamples = 0;
+	adrLastHeard = millis();
+	adrLastEval = adrLastHeard;
+	adrMark();
+	if (adrHandshake && (adrMode == ADR_LEADER)) {
+		// the follower changed first, give it something to hear us by
+		adrHello();
+	}
+	adrHandshake = false;
+}
+
+static void adrHello() {
+	char buf[8];
+	snprintf(buf, sizeof(buf), "<%cNH>", RADIO_CONFIG_CHAR);
+	sendUrgent(buf);
+}
+
+//  N0 off, N1 leader, N2 follower.  The handshake is NP<preset> from the
+//  leader and NA<preset> back from the follower on the old settings,
+//  then NH from the leader on the new ones and the follower answers it.
+//  Getting a proposal makes this end a follower if ADR was off, it
+//  needs the fallback running once the peer starts moving presets.
+static void handleAdrString(char *p) {
+	uint8_t preset = p[4] - '0';
+	switch (p[3]) {
+	case '0':
+		setAdrMode(ADR_OFF);
+		break;
+	case '1':
+		setAdrMode(ADR_LEADER);
+		break;
+	case '2':
+		setAdrMode(ADR_FOLLOWER);
+		break;
+	case 'P': {
+		if (adrStep(preset) < 0) {
+			break;
+		}
+		if (adrMode == ADR_OFF) {
+			setAdrMode(ADR_FOLLOWER);
+		}
+		char buf[10];
+		snprintf(buf, sizeof(buf), "<%cNA%d>", RADIO_CONFIG_CHAR, preset);
+		sendUrgent(buf);
+		adrSwitchTo = preset;
+		adrHandshake = true;
+		break;
+	}
+	case 'A':
+		if ((adrProposed != ADR_NO_PRESET) && (preset == adrProposed)) {
+			adrSwitchTo = preset;
+			adrHandshake = true;
+		}
+		break;
+	case 'H':
+		// hearing it at all was the point, the leader wants to hear us back
+		if (adrMode == ADR_FOLLOWER) {
+			adrHello();
+		}
+		break;
+	default:
+		break;
+	}
+}
+
 void resetRadio() {
 
 	// manual reset
@@ -245,6 +1711,16 @@ void resetRadio() {
 
 	radio.setTxPower(23, false);
 
+	// init puts the modem back to its defaults
+	currentSF = 7;
+	currentBW = 125000;
+	currentCR = 5;
+	currentPreset = 0;
+	if (fecEnabled) {
+		radio.setPayloadCRC(false);
+	}
+	updateAirtimeModel();
+
 }
 
 
@@ -28,9 +28,30 @@
 #include <SPI.h>
 
 
-#include <RH_RF95.h>
+//  The radio everything here talks to.  A host build can point these at a
+//  stand in with the same interface as RH_RF95 (send, recv, mode and the
+//  RHMode names, setModemConfig with the same preset names, lastRssi...)
+//  and run RadioCommon against it with its own millis().  A stand in
+//  without RadioHead's defines sets RADIO_MAX_MESSAGE_LEN and
+//  RADIO_HEADER_LEN itself.
+#ifndef RADIO_DRIVER_HEADER
+#define RADIO_DRIVER_HEADER <RH_RF95.h>
+#endif
+#ifndef RADIO_DRIVER_CLASS
+#define RADIO_DRIVER_CLASS RH_RF95
+#endif
+
+#include RADIO_DRIVER_HEADER
+
+#ifndef RADIO_MAX_MESSAGE_LEN
+#define RADIO_MAX_MESSAGE_LEN RH_RF95_MAX_MESSAGE_LEN
+#endif
+#ifndef RADIO_HEADER_LEN
+#define RADIO_HEADER_LEN RH_RF95_HEADER_LEN
+#endif
 
 #include <RobotSharedDefines.h>
+#include <ReedSolomon.h>
 
 //#define DEBUG_OUT Serial
 #ifdef DEBUG_OUT
@@ -41,27 +62,358 @@
 
 #define HOLDING_BUFFER_SIZE 64
 
+//  Largest single command processRadioBuffer will put back together
+#define RADIO_COMMAND_BUFFER_SIZE 64
+
+//  Packets waiting for their turn on the air.  Each slot holds one packet
+//  up to TX_SLOT_SIZE, anything bigger has to go through sendToRadio, or
+//  sendLarge if it's bigger than a packet.
+//  The holding buffer is also one of these slots so one can fill while
+//  another is on the air.
+#ifndef TX_QUEUE_DEPTH
+#define TX_QUEUE_DEPTH 3
+#endif
+#if TX_QUEUE_DEPTH < 2
+#error "TX_QUEUE_DEPTH needs one slot to fill while another is on the air"
+#endif
+#define TX_SLOT_SIZE HOLDING_BUFFER_SIZE
+
+//  A couple of slots just for urgent messages like stop commands
+#ifndef URGENT_QUEUE_DEPTH
+#define URGENT_QUEUE_DEPTH 2
+#endif
+
+//  Reliable mode puts a link header in front of every packet:
+//  '<', RADIO_SEQ_CODE, 7, flags, seq, ack, sack
+//  ack is the next sequence number expected from the peer, bit n of sack
+//  means ack + 1 + n got there too.  The header is taken back off in
+//  listenToRadio so the sketch never sees it.  RADIO_SEQ_CODE is reserved
+//  in RobotSharedDefines.h, outside the sketches' raw codes.
+//  Urgent packets are numbered and resent too, they wait for their ack
+//  in the urgent lane's own slots.  Large message fragments aren't.
+#define LINK_HEADER_SIZE 7
+#define LINK_SEQ_FLAG 0x01    // seq is good, this packet wants an ack
+#define LINK_ACK_FLAG 0x02    // ack and sack are good
+#define LINK_SYN_FLAG 0x04    // sender just started counting, take seq as the start
+
+//  Packets that can be on the air waiting for their ack.  They stay in
+//  their queue slots until then so this can't be more than TX_QUEUE_DEPTH,
+//  and the sack byte only covers 8 counting the urgent ones.
+#ifndef RELIABLE_WINDOW
+#define RELIABLE_WINDOW TX_QUEUE_DEPTH
+#endif
+#if RELIABLE_WINDOW > TX_QUEUE_DEPTH || RELIABLE_WINDOW + URGENT_QUEUE_DEPTH > 8
+#error "RELIABLE_WINDOW has to fit in the transmit queue, and it and the urgent lane in the sack bits"
+#endif
+#ifndef RELIABLE_ACK_DELAY
+#define RELIABLE_ACK_DELAY 40       // millis to wait for something to carry an ack before sending one alone
+#endif
+#ifndef RELIABLE_MAX_TRIES
+#define RELIABLE_MAX_TRIES 5
+#endif
+#ifndef RELIABLE_MIN_RTO
+#define RELIABLE_MIN_RTO 100
+#endif
+#ifndef RELIABLE_MAX_RTO
+#define RELIABLE_MAX_RTO 30000
+#endif
+#ifndef RELIABLE_MAX_BACKOFF
+#define RELIABLE_MAX_BACKOFF 4      // doublings of the timeout while the peer stays quiet
+#endif
+
+struct TxSlot {
+	uint8_t data[TX_SLOT_SIZE];
+	uint8_t length;
+	uint32_t queuedAt;
+	uint8_t seq;       // the rest is only used in reliable mode
+	uint8_t tries;
+	boolean sacked;    // the peer has it, or we gave up on it
+	uint32_t sentAt;
+};
+
+enum TxPriority {
+	PRIORITY_LOW,    // batched through the holding buffer
+	PRIORITY_HIGH,   // goes out on the next chance ahead of everything low, duty cycle or not
+	NUMBER_OF_PRIORITIES
+};
+
+struct LaneLatency {
+	uint32_t packets;
+	uint32_t totalMillis;
+	uint32_t maxMillis;
+
+	LaneLatency():packets(0), totalMillis(0), maxMillis(0){};
+};
+
+//  What addToHolding does when every slot is full.
+enum HoldingPolicy {
+	HOLD_BLOCK,        // wait for the radio like it always did
+	HOLD_DROP_NEW,     // throw away the new message
+	HOLD_DROP_OLDEST   // throw away the oldest packet that isn't on the air yet
+};
+
 #define RF95_FREQ 915.0
 
 //  This currently works out to 251  (255 buffer size - 4 byte header)
-#define MAX_MESSAGE_SIZE_RH RH_RF95_MAX_MESSAGE_LEN
+#define MAX_MESSAGE_SIZE_RH RADIO_MAX_MESSAGE_LEN
 //#define MAX_MESSAGE_SIZE_RH HOLDING_BUFFER_SIZE
 
+//  With FEC on (F1) a packet goes out as RADIO_FEC_MARKER, the packet,
+//  then RADIO_FEC_PARITY Reed-Solomon bytes.  That fixes up to half that
+//  many bad bytes.  F1 also sends our packets without the radio's CRC so
+//  the peer's radio hands them up damaged instead of dropping them.  It
+//  doesn't change what this end's radio drops, that's the peer's CRC
+//  setting.  Packets never start with the marker otherwise.
+#ifndef RADIO_FEC_PARITY
+#define RADIO_FEC_PARITY 8
+#endif
+#if RADIO_FEC_PARITY > RS_MAX_PARITY
+#error "RADIO_FEC_PARITY is more than ReedSolomon handles"
+#endif
+#define RADIO_FEC_MARKER 0xFE
+#define FEC_OVERHEAD (1 + RADIO_FEC_PARITY)
+
+//  Messages too big for one packet go as fragment frames:
+//  '<', RADIO_FRAG_CODE, length, msgId, fragIndex, fragCount, payload
+//  Every fragment but the last is full so the receiver knows where each
+//  one goes.  They're sized so a fragment with a link header in front
+//  and the FEC bytes still fills a whole packet.  RADIO_FRAG_CODE is
+//  reserved in RobotSharedDefines.h.
+#define FRAG_HEADER_SIZE 6
+#define FRAG_PAYLOAD_SIZE (MAX_MESSAGE_SIZE_RH - FEC_OVERHEAD - LINK_HEADER_SIZE - FRAG_HEADER_SIZE)
+
+//  sendLarge builds each fragment right in the caller's buffer, so the
+//  message has to start RADIO_LARGE_HEADROOM bytes in and have room for
+//  the parity after it:
+//    uint8_t buf[RADIO_LARGE_BUFFER_SIZE(300)];
+//    ... message goes at buf + RADIO_LARGE_HEADROOM ...
+//    sendLarge(buf, 300);
+#define RADIO_LARGE_HEADROOM (1 + LINK_HEADER_SIZE + FRAG_HEADER_SIZE)
+#define RADIO_LARGE_BUFFER_SIZE(n) (RADIO_LARGE_HEADROOM + (n) + RADIO_FEC_PARITY)
+
+//  Largest message sendLarge takes and the receiver puts back together.
+//  Each reassembly slot costs about this much RAM, so there are none
+//  unless you ask for them.  With 0 slots fragments coming in are dropped.
+#ifndef RADIO_LARGE_MESSAGE_SIZE
+#define RADIO_LARGE_MESSAGE_SIZE (2 * FRAG_PAYLOAD_SIZE)
+#endif
+#ifndef RADIO_REASSEMBLY_SLOTS
+#define RADIO_REASSEMBLY_SLOTS 0
+#endif
+//  An unfinished message is thrown out if no fragment of it shows up for
+//  this long, or three full packet times if that's longer.
+#ifndef RADIO_REASSEMBLY_TIMEOUT
+#define RADIO_REASSEMBLY_TIMEOUT 2000
+#endif
+
+#define RADIO_MAX_FRAGMENTS ((RADIO_LARGE_MESSAGE_SIZE + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE)
+#if RADIO_MAX_FRAGMENTS > 32
+#error "RADIO_LARGE_MESSAGE_SIZE needs more fragments than a reassembly slot can keep track of"
+#endif
+
+struct ReassemblySlot {
+	uint8_t data[RADIO_LARGE_MESSAGE_SIZE];
+	uint16_t length;      // known once the last fragment is in
+	uint32_t received;    // bit n set when fragment n is in
+	uint32_t lastHeard;
+	uint8_t msgId;
+	uint8_t fragCount;
+	boolean active;
+};
+
+enum FlushCause {
+	FLUSH_SIZE,       // holding buffer was full
+	FLUSH_INTERVAL,   // held too long, or the adaptive interval came up
+	FLUSH_OTHER,      // someone called flush or queued past the holding buffer
+	NUMBER_OF_FLUSH_CAUSES
+};
+
+struct RadioStats {
+	int16_t lastRssi;
+	int16_t lastSnr;
+	int32_t avgRssi16;    // running averages, times 16
+	int32_t avgSnr16;
+	uint32_t packetsSent;
+	uint32_t packetsReceived;
+	uint32_t bytesSent;
+	uint32_t bytesReceived;
+	uint16_t flushes[NUMBER_OF_FLUSH_CAUSES];
+	uint32_t blockedMicros;   // spent stuck in waitPacketSent
+	uint32_t airtimeMicros;   // predicted time on air of everything sent
+	uint16_t retransmits;     // reliable mode
+	uint16_t duplicates;
+	uint16_t giveUps;         // packets dropped after RELIABLE_MAX_TRIES, or to free a slot for HOLD_BLOCK
+	uint16_t seqGaps;         // numbers the peer skipped, missing when a later one got here
+	uint16_t reassemblyTimeouts;
+	uint16_t fragmentDrops;   // bad fragments, or no slot free for them
+	uint16_t fecCorrected;    // bytes fixed
+	uint16_t fecFailures;     // packets too damaged to fix
+	uint32_t since;           // millis when these were cleared
+
+	RadioStats():lastRssi(0), lastSnr(0), avgRssi16(0), avgSnr16(0), packetsSent(0), packetsReceived(0),
+			bytesSent(0), bytesReceived(0), flushes{0, 0, 0}, blockedMicros(0), airtimeMicros(0),
+			retransmits(0), duplicates(0), giveUps(0), seqGaps(0), reassemblyTimeouts(0), fragmentDrops(0),
+			fecCorrected(0), fecFailures(0), since(0){};
+};
+
+//  Second character of the config frames that go to the peer's
+//  handleConfigString, the adaptive data rate handshake goes out as
+//  <rN...>.  Has to match whatever the sketches route to it.
+#ifndef RADIO_CONFIG_CHAR
+#define RADIO_CONFIG_CHAR 'r'
+#endif
+
+//  Adaptive data rate.  Margins are in dB over what the current preset
+//  needs, times are in millis.  It needs traffic to judge the link by so
+//  the keepalives have to keep flowing both ways.
+#ifndef ADR_UP_MARGIN
+#define ADR_UP_MARGIN 10        // margin the faster preset would still have before stepping up
+#endif
+#ifndef ADR_DOWN_MARGIN
+#define ADR_DOWN_MARGIN 4       // step to a more robust preset below this
+#endif
+#ifndef ADR_DOWN_LOSS
+#define ADR_DOWN_LOSS 20        // or this many percent resent, given up on or skipped with under ADR_UP_MARGIN
+#endif
+#ifndef ADR_MIN_SAMPLES
+#define ADR_MIN_SAMPLES 8       // packets heard on a preset before judging it
+#endif
+#ifndef ADR_LOSS_SAMPLES
+#define ADR_LOSS_SAMPLES 24     // packets sent and heard before the loss counts for anything
+#endif
+#ifndef ADR_EVAL_INTERVAL
+#define ADR_EVAL_INTERVAL 2000
+#endif
+#ifndef ADR_LOSS_TIMEOUT
+#define ADR_LOSS_TIMEOUT 2000   // this quiet counts as loss and the leader asks to slow down
+#endif
+#ifndef ADR_FALLBACK_TIMEOUT
+#define ADR_FALLBACK_TIMEOUT 6000   // this quiet and both ends drop to the most robust preset
+#endif
+#ifndef ADR_HANDSHAKE_TIMEOUT
+#define ADR_HANDSHAKE_TIMEOUT 1500  // for the accept, and to hear the other end after a switch before going back
+#endif
+
+#define ADR_NO_PRESET 0xFF
+
+//  Only one end picks the preset, the other one follows it.
+enum AdrMode {
+	ADR_OFF,
+	ADR_LEADER,
+	ADR_FOLLOWER
+};
+
+typedef void (*radioRawFunc)(uint8_t*);
+typedef void (*radioCommandFunc)(char*);
+//  A reassembled large message, only good until the handler returns
+typedef void (*radioLargeFunc)(uint8_t*, uint16_t);
+
+//  Framing state for one incoming link.  Each one puts its own commands
+//  back together and hands them to its own handlers, so a second radio
+//  or a loopback test link doesn't trip over the first.
+class RadioLink {
+
+private:
+	boolean receiving;
+	boolean receivingRaw;
+	char commandBuffer[RADIO_COMMAND_BUFFER_SIZE];
+	int index;
+
+	radioRawFunc rawHandler;
+	radioCommandFunc commandHandler;
+	radioLargeFunc largeHandler;
+
+	ReassemblySlot *fragSlot;    // where the fragment coming in goes, NULL to skip it
+	uint16_t fragOffset;
+
+	void startFragment();
+	void endFragment();
+
+public:
+
+	RadioLink(radioRawFunc, radioCommandFunc);
+
+	void process(uint8_t*, uint8_t);
+	void reset();
+
+	void setRawHandler(radioRawFunc);
+	void setCommandHandler(radioCommandFunc);
+	//  Fragments are ignored until this is set, and there have to be
+	//  RADIO_REASSEMBLY_SLOTS to put them back together in
+	void setLargeHandler(radioLargeFunc);
+
+};
+
+//  The sketch makes this one
+extern RADIO_DRIVER_CLASS radio;
+
+//  The default link, bound to the sketch's handleRawRadio and handleRadioCommand
+extern RadioLink radioLink;
+
 void initRadio(uint8_t);
 
 void listenToRadio();
 void handleOutput();
 void processRadioBuffer(uint8_t*, uint8_t);
 
-void addToHolding(uint8_t*, uint8_t);
-void addToHolding(char*);
-void sendToRadio(uint8_t*, uint8_t);
-void sendToRadio(char*);
+boolean addToHolding(uint8_t*, uint8_t);
+boolean addToHolding(char*);
+boolean sendToRadio(uint8_t*, uint8_t);
+boolean sendToRadio(char*);
 void flush();
 
+boolean queueToRadio(uint8_t*, uint8_t);
+boolean queueToRadio(char*);
+boolean queueToRadio(uint8_t*, uint8_t, TxPriority);
+boolean sendUrgent(uint8_t*, uint8_t);
+boolean sendUrgent(char*);
+void handleTransmit();
+void waitForQueueSpace();
+uint8_t txQueueDepth();
+uint8_t urgentQueueDepth();
+boolean txBusy();
+uint32_t txPacketsDone();
+const LaneLatency& getLaneLatency(TxPriority);
+void clearLaneLatency();
+
+void setFec(boolean);
+boolean getFec();
+
+boolean sendLarge(uint8_t*, uint16_t);
+boolean largeBusy();
+
+void setReliable(boolean);
+boolean getReliable();
+uint32_t reliableRto();
+
+void setHoldingPolicy(HoldingPolicy);
+uint8_t holdingSlotsFree();
+boolean holdingBackpressure();
+uint16_t holdingDrops();
+
 void handleConfigString(char*);
 void resetRadio();
 
+void waitForRadio();
+const RadioStats& getRadioStats();
+void clearRadioStats();
+uint16_t channelUtilization();
+void sendRadioStats();
+
+void setModemPreset(uint8_t);
+uint32_t loraTimeOnAir(uint8_t);
+uint32_t getAdaptiveFlushInterval();
+uint32_t getMaxFlushInterval();
+uint16_t getDutyCycle();
+boolean getAdaptiveFlush();
+uint8_t getSpreadingFactor();
+uint32_t getBandwidth();
+uint8_t getCodingRate();
+uint8_t getModemPreset();
+
+void setAdrMode(AdrMode);
+AdrMode getAdrMode();
+
 
 
 
@@ -0,0 +1,200 @@
+/*
+
+ReedSolomon  --  byte wise Reed-Solomon over GF(256) for fixing up radio
+                 packets that came in with a few bad bytes.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "ReedSolomon.h"
+
+// x^8 + x^4 + x^3 + x^2 + 1, alpha is 2
+#define GF_POLY 0x1D
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+	uint8_t result = 0;
+	while (b) {
+		if (b & 1) {
+			result ^= a;
+		}
+		a = (a & 0x80) ? ((a << 1) ^ GF_POLY) : (a << 1);
+		b >>= 1;
+	}
+	return result;
+}
+
+//  a^254 is 1/a since every non zero element to the 255th is 1
+uint8_t gfInv(uint8_t a) {
+	uint8_t result = 1;
+	uint8_t square = a;
+	for (uint8_t e = 254; e; e >>= 1) {
+		if (e & 1) {
+			result = gfMul(result, square);
+		}
+		square = gfMul(square, square);
+	}
+	return result;
+}
+
+//  The generator has alpha^0 through alpha^(parity-1) as its roots
+ReedSolomon::ReedSolomon(uint8_t aParity) {
+	parity = (aParity > RS_MAX_PARITY) ? RS_MAX_PARITY : aParity;
+	memset(generator, 0, sizeof(generator));
+	generator[0] = 1;
+	uint8_t root = 1;
+	for (uint8_t i = 0; i < parity; i++) {
+		// multiply by (x + root)
+		for (uint8_t j = i + 1; j > 0; j--) {
+			generator[j] ^= gfMul(generator[j - 1], root);
+		}
+		root = gfMul(root, 2);
+	}
+}
+
+//  Remainder of the data times x^parity divided by the generator, worked
+//  a byte at a time like a CRC.
+void ReedSolomon::encode(const uint8_t *aData, uint8_t aLength, uint8_t *aParity) {
+	memset(aParity, 0, parity);
+	for (uint8_t i = 0; i < aLength; i++) {
+		uint8_t feedback = aData[i] ^ aParity[0];
+		memmove(aParity, aParity + 1, parity - 1);
+		aParity[parity - 1] = 0;
+		if (feedback) {
+			for (uint8_t j = 0; j < parity; j++) {
+				aParity[j] ^= gfMul(generator[j + 1], feedback);
+			}
+		}
+	}
+}
+
+//  The codeword as a polynomial at x, first byte is the highest power
+uint8_t ReedSolomon::evaluate(const uint8_t *aCodeword, uint8_t aLength, uint8_t x) {
+	uint8_t result = 0;
+	for (uint8_t i = 0; i < aLength; i++) {
+		result = gfMul(result, x) ^ aCodeword[i];
+	}
+	return result;
+}
+
+//  Syndromes, then Berlekamp-Massey for the error locator, a Chien search
+//  to find where the errors are and Forney to work out what they were.
+//  Nothing past the syndromes runs unless something is actually wrong.
+int ReedSolomon::decode(uint8_t *aCodeword, uint8_t aLength) {
+	if (aLength <= parity) {
+		return -1;
+	}
+	uint8_t syndromes[RS_MAX_PARITY];
+	boolean clean = true;
+	uint8_t x = 1;
+	for (uint8_t i = 0; i < parity; i++) {
+		syndromes[i] = evaluate(aCodeword, aLength, x);
+		if (syndromes[i]) {
+			clean = false;
+		}
+		x = gfMul(x, 2);
+	}
+	if (clean) {
+		return 0;
+	}
+
+	// Berlekamp-Massey, these polynomials are lowest power first
+	uint8_t locator[RS_MAX_PARITY + 1];
+	uint8_t previous[RS_MAX_PARITY + 1];
+	uint8_t temp[RS_MAX_PARITY + 1];
+	memset(locator, 0, sizeof(locator));
+	memset(previous, 0, sizeof(previous));
+	locator[0] = 1;
+	previous[0] = 1;
+	uint8_t errors = 0;
+	uint8_t shift = 1;
+	uint8_t lastDiscrepancy = 1;
+	for (uint8_t n = 0; n < parity; n++) {
+		uint8_t discrepancy = syndromes[n];
+		for (uint8_t i = 1; i <= errors; i++) {
+			discrepancy ^= gfMul(locator[i], syndromes[n - i]);
+		}
+		if (discrepancy == 0) {
+			shift++;
+			continue;
+		}
+		uint8_t scale = gfMul(discrepancy, gfInv(lastDiscrepancy));
+		memcpy(temp, locator, sizeof(locator));
+		for (uint8_t i = 0; i + shift <= parity; i++) {
+			locator[i + shift] ^= gfMul(scale, previous[i]);
+		}
+		if (2 * errors <= n) {
+			errors = n + 1 - errors;
+			memcpy(previous, temp, sizeof(previous));
+			lastDiscrepancy = discrepancy;
+			shift = 1;
+		} else {
+			shift++;
+		}
+	}
+	if (2 * errors > parity) {
+		return -1;
+	}
+
+	// error evaluator, syndromes times the locator, only the low terms matter
+	uint8_t evaluator[RS_MAX_PARITY];
+	for (uint8_t i = 0; i < parity; i++) {
+		evaluator[i] = 0;
+		for (uint8_t j = 0; (j <= i) && (j <= errors); j++) {
+			evaluator[i] ^= gfMul(locator[j], syndromes[i - j]);
+		}
+	}
+
+	// The byte at index i goes with alpha^(aLength-1-i), so walk from the
+	// end of the codeword where that's alpha^0 and its inverse is easy to step.
+	uint8_t found = 0;
+	uint8_t position = 1;
+	uint8_t inverse = 1;
+	const uint8_t alphaInverse = gfInv(2);
+	for (int i = aLength - 1; i >= 0; i--) {
+		uint8_t sum = 0;
+		uint8_t power = 1;
+		uint8_t derivative = 0;
+		for (uint8_t j = 0; j <= errors; j++) {
+			uint8_t term = gfMul(locator[j], power);
+			sum ^= term;
+			if (j & 1) {
+				// formal derivative only keeps the odd terms, one power down
+				derivative ^= gfMul(locator[j], gfMul(power, position));
+			}
+			power = gfMul(power, inverse);
+		}
+		if (sum == 0) {
+			uint8_t omega = 0;
+			power = 1;
+			for (uint8_t j = 0; j < parity; j++) {
+				omega ^= gfMul(evaluator[j], power);
+				power = gfMul(power, inverse);
+			}
+			if (derivative == 0) {
+				return -1;
+			}
+			aCodeword[i] ^= gfMul(position, gfMul(omega, gfInv(derivative)));
+			found++;
+		}
+		position = gfMul(position, 2);
+		inverse = gfMul(inverse, alphaInverse);
+	}
+	if (found != errors) {
+		// more errors than it can see, what it fixed is probably wrong too
+		return -1;
+	}
+	return found;
+}
@@ -0,0 +1,58 @@
+/*
+
+ReedSolomon  --  byte wise Reed-Solomon over GF(256) for fixing up radio
+                 packets that came in with a few bad bytes.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef REEDSOLOMON_H_
+#define REEDSOLOMON_H_
+
+#include "Arduino.h"
+
+//  The decoder keeps a few arrays this size on the stack
+#define RS_MAX_PARITY 16
+
+//  Multiplies by shifting and adding instead of looking up log tables,
+//  slower but it doesn't cost 512 bytes of RAM.
+uint8_t gfMul(uint8_t, uint8_t);
+uint8_t gfInv(uint8_t);
+
+//  n parity bytes fix up to n/2 bad bytes anywhere in a codeword of up
+//  to 255 bytes.  The parity bytes go right after the data.
+class ReedSolomon {
+
+private:
+	uint8_t parity;
+	uint8_t generator[RS_MAX_PARITY + 1];   // highest power first, generator[0] is 1
+
+	uint8_t evaluate(const uint8_t*, uint8_t, uint8_t);
+
+public:
+
+	ReedSolomon(uint8_t aParity);
+
+	void encode(const uint8_t *aData, uint8_t aLength, uint8_t *aParity);
+	//  Fixes aCodeword in place.  Returns how many bytes it fixed or -1
+	//  if there were too many to fix.
+	int decode(uint8_t *aCodeword, uint8_t aLength);
+
+	uint8_t getParity(){return parity;}
+
+};
+
+#endif /* REEDSOLOMON_H_ */
@@ -34,6 +34,15 @@ enum DriveModeEnum {
 
 #define XBOX_RAW_BUFFER_SIZE 14
 
+// Binary controller frame:  '<', code, total length, then the 14 byte ControllerUnion
+#define XBOX_BINARY_CODE 0x14
+#define XBOX_BINARY_FRAME_SIZE (3 + XBOX_RAW_BUFFER_SIZE)
+
+// Raw frame codes 0x11 - 0x14 belong to the sketches.  The radio link
+// keeps these for itself and takes them back off before anyone sees them.
+#define RADIO_SEQ_CODE 0x1E
+#define RADIO_FRAG_CODE 0x1F
+
 #define ROBOT_DATA_DUMP_SIZE 22
 
 #define ARM_DUMP_SIZE 22
@@ -22,7 +22,21 @@ StreamParser   --  Parses any Stream object for data with end markers.
 #include "StreamParser.h"
 
 
-void StreamParser::run() {
+void StreamParserBase::attach(Stream *aIn, char aSop, char aEop,
+		void (*aCallback)(char*), char *aBuffer, int aSize) {
+	in = aIn;
+	sop = aSop;
+	eop = aEop;
+	callback = aCallback;
+	rawCallback = aCallback;
+	_SPbuffer = aBuffer;
+	bufferSize = aSize;
+	index = 0;
+	receiving = false;
+	receivingRaw = false;
+}
+
+void StreamParserBase::run() {
 
 //	if (receivingRaw) {
 //		handleRawData();
@@ -35,69 +49,308 @@ void StreamParser::run() {
 	}
 }
 
-void StreamParser::handleChar(char c) {
+//  Drains everything available() reported on the way in, in chunks with
+//  readBytes(), and hands each chunk to handleBlock().  Greedy goes back
+//  to ask for more once that's used up.
+void StreamParserBase::runBulk() {
+
+	int avail = in->available();
+	while (avail > 0) {
+		char chunk[STREAMPARSER_CHUNK_SIZE];
+		int num = (avail > STREAMPARSER_CHUNK_SIZE) ? STREAMPARSER_CHUNK_SIZE : avail;
+		// readBytes won't wait on the timeout since we never ask for more than available()
+		num = in->readBytes(chunk, num);
+		if (num <= 0) {
+			break;
+		}
+		handleBlock(chunk, num);
+		avail -= num;
+		if ((avail <= 0) && greedy) {
+			avail = in->available();
+		}
+	}
+}
+
+//  Drains input until it runs out or until either budget is used up.
+//  A budget of 0 means no limit on that one.  Returns the bytes consumed,
+//  use inputPending() to see if anything got left behind.
+int StreamParserBase::run(int aMaxBytes, uint32_t aMaxMicros) {
+
+	uint32_t startTime = micros();
+	int count = 0;
+	while (in->available()) {
+		handleChar(in->read());
+		count++;
+		if (aMaxBytes && count >= aMaxBytes) {
+			break;
+		}
+		if (aMaxMicros && (micros() - startTime >= aMaxMicros)) {
+			break;
+		}
+	}
+	return count;
+}
+
+//  Same as above with chunked reads.  The time budget is checked between chunks.
+int StreamParserBase::runBulk(int aMaxBytes, uint32_t aMaxMicros) {
+
+	uint32_t startTime = micros();
+	int count = 0;
+	int avail = in->available();
+	while (avail > 0) {
+		char chunk[STREAMPARSER_CHUNK_SIZE];
+		int num = (avail > STREAMPARSER_CHUNK_SIZE) ? STREAMPARSER_CHUNK_SIZE : avail;
+		if (aMaxBytes && (num > aMaxBytes - count)) {
+			num = aMaxBytes - count;
+		}
+		num = in->readBytes(chunk, num);
+		if (num <= 0) {
+			break;
+		}
+		handleBlock(chunk, num);
+		count += num;
+		if (aMaxBytes && count >= aMaxBytes) {
+			break;
+		}
+		if (aMaxMicros && (micros() - startTime >= aMaxMicros)) {
+			break;
+		}
+		avail = in->available();
+	}
+	return count;
+}
+
+boolean StreamParserBase::inputPending() {
+	return (in->available() > 0);
+}
+
+int StreamParserBase::inputBacklog() {
+	return in->available();
+}
+
+void StreamParserBase::handleChar(char c) {
 	if (receivingRaw) {
 		handleRawData(c);
 	} else {
-		if (c == sop) {
+		// a raw frame's length byte can be anything, even the start marker
+		boolean rawLength = (receiving && (index == 2) && (_SPbuffer[1] >= 0x11)
+				&& (_SPbuffer[1] <= 0x14));
+		if ((c == sop) && !rawLength) {
+			SP_STAT(if (receiving) discard(index));
 			receiving = true;
 			index = 0;
-			_SPbuffer[0] = 0;
 		}
 		if (receiving) {
-			_SPbuffer[index] = c;
-			_SPbuffer[++index] = 0;
+			_SPbuffer[index++] = c;
 			if ((index == 3) && (_SPbuffer[1] >= 0x11)
 					&& (_SPbuffer[1] <= 0x14)) {
-				receivingRaw = true;
 				receiving = false;
+				if ((uint8_t) _SPbuffer[2] <= 3) {
+					// nothing past the header, waiting on one more byte
+					// would put the terminator past a 4 byte buffer
+					deliver(true);
+					return;
+				}
+				receivingRaw = true;
 				return;
 			}
-			if (index >= STREAMPARSER_BUFFER_SIZE - 1) {
-				index--;
-			}
 			if (c == eop) {
 				receiving = false;
-				callback(_SPbuffer);
+				deliver(false);
+				return;
 			}
+			if (index >= bufferSize - 1) {
+				SP_STAT(stats.overflows++);
+				index--;
+			}
+		} else {
+			SP_STAT(discard(1));
 		}
 	}
 }
 
-void StreamParser::handleRawData(char c) {
+void StreamParserBase::handleRawData(char c) {
 
 	// To get here we already have < and the code and the number of bytes in the buffer
 
-	int numBytes = _SPbuffer[2];
-	if(numBytes >= STREAMPARSER_BUFFER_SIZE){
+	// length byte is unsigned, anything past 127 used to come out negative
+	int numBytes = (uint8_t) _SPbuffer[2];
+	if(numBytes >= bufferSize){
 		receivingRaw = false;
+		SP_STAT(stats.badLengths++);
+		SP_STAT(discard(index + 1));
 		return;
 	}
 
-	_SPbuffer[index] = c;
-	_SPbuffer[++index] = 0;  // why not null terminate
+	_SPbuffer[index++] = c;
 
 	if (index >= numBytes) {
 		receivingRaw = false;
-		rawCallback(_SPbuffer);
+		deliver(true);
+	}
+
+}
+
+//  The frame only gets null terminated once here when it's complete.
+//  View callbacks get the length too so they don't need to look for it.
+void StreamParserBase::deliver(boolean aRaw) {
+	_SPbuffer[index] = 0;
+#ifdef STREAMPARSER_STATS
+	stats.frames++;
+	if (stats.resyncRun > stats.maxResync) {
+		stats.maxResync = stats.resyncRun;
+	}
+	stats.resyncRun = 0;
+#endif
+	if (aRaw) {
+		if (rawContextCallback) {
+			rawContextCallback(rawContext, _SPbuffer, index);
+		} else if (rawViewCallback) {
+			rawViewCallback(_SPbuffer, index);
+		} else {
+			rawCallback(_SPbuffer);
+		}
+	} else {
+		if (contextCallback) {
+			contextCallback(context, _SPbuffer, index);
+		} else if (viewCallback) {
+			viewCallback(_SPbuffer, index);
+		} else {
+			callback(_SPbuffer);
+		}
 	}
+}
+
+//  Same result as calling handleChar for every byte in aBuf, but finds the
+//  markers with memchr and copies the frame bodies over in blocks.
+void StreamParserBase::handleBlock(const char *aBuf, int aLen) {
+
+	const char *p = aBuf;
+	const char *end = aBuf + aLen;
+
+	while (p < end) {
+		if (receivingRaw) {
+			int numBytes = (uint8_t) _SPbuffer[2];
+			int need = numBytes - index;
+			if ((numBytes >= bufferSize) || (need <= 1)) {
+				// bad length or last byte, let handleRawData sort it out
+				handleRawData(*p++);
+				continue;
+			}
+			if (need > end - p) {
+				need = end - p;
+			}
+			memcpy(_SPbuffer + index, p, need);
+			index += need;
+			p += need;
+			if (index >= numBytes) {
+				receivingRaw = false;
+				deliver(true);
+			}
+		} else if (!receiving) {
+			// nothing matters until the next start marker
+			const char *found = (const char*) memchr(p, sop, end - p);
+			if (found == NULL) {
+				SP_STAT(discard(end - p));
+				return;
+			}
+			SP_STAT(discard(found - p));
+			p = found;
+			handleChar(*p++);
+		} else if (index < 3) {
+			// first bytes decide between a raw and an ascii frame
+			handleChar(*p++);
+		} else {
+			const char *stop = (const char*) memchr(p, eop, end - p);
+			const char *limit = (stop != NULL) ? stop : end;
+			// a new start marker before the end restarts the frame
+			const char *restart = (const char*) memchr(p, sop, limit - p);
+			if (restart != NULL) {
+				limit = restart;
+			}
+			if (limit > p) {
+				appendBlock(p, limit - p);
+				p = limit;
+			}
+			if (p < end) {
+				handleChar(*p++);
+			}
+		}
+	}
+}
+
+//  Copies a run of frame body bytes that has no markers in it.  Overflow
+//  is handled like handleChar does it, the last slot keeps getting overwritten.
+void StreamParserBase::appendBlock(const char *aBuf, int aLen) {
 
+	int fit = (bufferSize - 1) - index;
+	if (aLen < fit) {
+		memcpy(_SPbuffer + index, aBuf, aLen);
+		index += aLen;
+	} else {
+		memcpy(_SPbuffer + index, aBuf, fit - 1);
+		SP_STAT(stats.overflows += aLen - fit + 1);
+		index = bufferSize - 2;
+		_SPbuffer[index] = aBuf[aLen - 1];
+	}
 }
 
-void StreamParser::setCallback(void (*aCall)(char*)){
+void StreamParserBase::setCallback(void (*aCall)(char*)){
 	callback = aCall;
 }
 
-void StreamParser::setRawCallback(void (*aCall)(char*)){
+void StreamParserBase::setRawCallback(void (*aCall)(char*)){
 	rawCallback = aCall;
 }
 
+//  Setting a view callback takes precedence over the char* one.
+//  Set it back to NULL to go back to the old callback.
+void StreamParserBase::setViewCallback(frameViewFunc aCall){
+	viewCallback = aCall;
+}
+
+void StreamParserBase::setRawViewCallback(frameViewFunc aCall){
+	rawViewCallback = aCall;
+}
+
+//  Context callbacks go ahead of view callbacks.  Raw and ascii each
+//  keep their own context pointer.
+void StreamParserBase::setContextCallback(frameContextFunc aCall, void* aContext){
+	contextCallback = aCall;
+	context = aContext;
+}
+
+void StreamParserBase::setRawContextCallback(frameContextFunc aCall, void* aContext){
+	rawContextCallback = aCall;
+	rawContext = aContext;
+}
+
 
-void StreamParser::setGreedy(bool aBoo){
+void StreamParserBase::setGreedy(bool aBoo){
 	greedy = aBoo;
 }
 
-bool StreamParser::getGreedy(){
+bool StreamParserBase::getGreedy(){
 	return greedy;
 }
 
+#ifdef STREAMPARSER_STATS
+
+void StreamParserBase::discard(int aNum) {
+	stats.discarded += aNum;
+	if (stats.resyncRun < 0xFFFF - aNum) {
+		stats.resyncRun += aNum;
+	} else {
+		stats.resyncRun = 0xFFFF;
+	}
+}
+
+const StreamParserStats& StreamParserBase::getStats() {
+	return stats;
+}
+
+void StreamParserBase::clearStats() {
+	stats = StreamParserStats();
+}
+
+#endif
@@ -27,11 +27,54 @@ StreamParser   --  Parses any Stream object for data with end markers.
 #define STREAMPARSER_BUFFER_SIZE 64
 #endif
 
+//  How many bytes runBulk() pulls out of the Stream per readBytes() call.
+//  This lives on the stack, not in the object.
+#ifndef STREAMPARSER_CHUNK_SIZE
+#define STREAMPARSER_CHUNK_SIZE 32
+#endif
+
+//  Define STREAMPARSER_STATS to have every parser keep count of what it
+//  delivered and what it had to throw away.  Costs nothing when it's off.
+#ifdef STREAMPARSER_STATS
+#define SP_STAT(x) x
+
+struct StreamParserStats {
+	uint32_t frames;       // ascii and raw frames delivered
+	uint32_t discarded;    // bytes thrown away hunting for a start marker or in dropped frames
+	uint16_t resyncRun;    // bytes discarded since the last good frame
+	uint16_t maxResync;    // worst resyncRun that ended in a good frame
+	uint16_t overflows;    // ascii bytes lost because the frame was longer than the buffer
+	uint16_t badLengths;   // raw frames dropped because the length byte didn't fit the buffer
+
+	StreamParserStats():frames(0), discarded(0), resyncRun(0), maxResync(0), overflows(0), badLengths(0){};
+};
+#else
+#define SP_STAT(x)
+#endif
+
+//  Gets a pointer into the parser's own buffer and the frame length.
+//  Only good until the callback returns, the next frame overwrites it.
+typedef void (*frameViewFunc)(char*, int);
+
+//  Same view, plus the context pointer given when it was set.  Lets one
+//  handler serve several links without a global lookup.
+typedef void (*frameContextFunc)(void*, char*, int);
 
-class StreamParser {
+//  Binds a member function as a frameContextFunc with the object as the
+//  context, no heap needed:
+//    parser.setContextCallback(frameMember<Arm, &Arm::handleFrame>, &arm);
+template<class T, void (T::*M)(char*, int)>
+void frameMember(void* aContext, char* aFrame, int aLength) {
+	(static_cast<T*>(aContext)->*M)(aFrame, aLength);
+}
+
+//  All of the parsing lives here.  It works out of whatever buffer it is
+//  given so a StreamParserHub can hand out pieces of one shared arena.
+class StreamParserBase {
 
 private:
-	char _SPbuffer[STREAMPARSER_BUFFER_SIZE];
+	char* _SPbuffer;
+	int bufferSize;
 	int index;
 
 	Stream* in;
@@ -41,27 +84,92 @@ private:
 	void (*callback)(char*);
 	void (*rawCallback)(char*);
 
+	frameViewFunc viewCallback = NULL;
+	frameViewFunc rawViewCallback = NULL;
+
+	frameContextFunc contextCallback = NULL;
+	frameContextFunc rawContextCallback = NULL;
+	void* context = NULL;
+	void* rawContext = NULL;
+
 	boolean receiving = false;
 	boolean receivingRaw = false;
 
 	boolean greedy = false;
 
+#ifdef STREAMPARSER_STATS
+	StreamParserStats stats;
+	void discard(int);
+#endif
+
+	void appendBlock(const char*, int);
+	void deliver(boolean);
+
 
 public:
 
-	StreamParser(Stream* aIn, char aSop, char aEop, void(*aCallback)(char*)):index(0), in(aIn), sop(aSop), eop(aEop), callback(aCallback), rawCallback(aCallback){};
-	StreamParser(Stream* aIn, void(*aCallback)(char*)):index(0), in(aIn), sop('<'), eop('>'), callback(aCallback), rawCallback(aCallback){};
+	StreamParserBase():_SPbuffer(NULL), bufferSize(0), index(0), in(NULL), sop('<'), eop('>'), callback(NULL), rawCallback(NULL){};
+	StreamParserBase(Stream* aIn, char aSop, char aEop, void(*aCallback)(char*), char* aBuffer, int aSize):_SPbuffer(aBuffer), bufferSize(aSize), index(0), in(aIn), sop(aSop), eop(aEop), callback(aCallback), rawCallback(aCallback){};
+	void attach(Stream* aIn, char aSop, char aEop, void(*aCallback)(char*), char* aBuffer, int aSize);
 	void run();
+	void runBulk();
+	int run(int aMaxBytes, uint32_t aMaxMicros = 0);
+	int runBulk(int aMaxBytes, uint32_t aMaxMicros = 0);
+	boolean inputPending();
+	int inputBacklog();
 	void handleChar(char c);
+	void handleBlock(const char*, int);
 
 	void handleRawData(char C);
 
 	void setCallback(void (*aCall)(char*));
 	void setRawCallback(void (*aCall)(char*));
+	void setViewCallback(frameViewFunc);
+	void setRawViewCallback(frameViewFunc);
+	void setContextCallback(frameContextFunc, void*);
+	void setRawContextCallback(frameContextFunc, void*);
 
 	void setGreedy(bool);
 	bool getGreedy();
 
+#ifdef STREAMPARSER_STATS
+	const StreamParserStats& getStats();
+	void clearStats();
+#endif
+
+};
+
+//  Owns a buffer sized for the largest frame this one link will ever see.
+//  A raw frame has to be shorter than N, so a link carrying only the 17
+//  byte binary Xbox frame needs StreamParserN<18>.  The ascii Xbox frame
+//  is 28 hex characters plus framing and needs StreamParserN<32>.
+//  ramCost() is the whole object, buffer included, as a compile time constant.
+template<int N>
+class StreamParserN : public StreamParserBase {
+
+	static_assert(N >= 4, "StreamParser buffer needs room for a raw header and terminator");
+
+private:
+	char storage[N];
+
+public:
+
+	StreamParserN(Stream* aIn, char aSop, char aEop, void(*aCallback)(char*)):StreamParserBase(aIn, aSop, aEop, aCallback, storage, N){};
+	StreamParserN(Stream* aIn, void(*aCallback)(char*)):StreamParserBase(aIn, '<', '>', aCallback, storage, N){};
+
+	static constexpr int bufferSize(){return N;}
+	static constexpr int ramCost(){return sizeof(StreamParserN<N>);}
+
+};
+
+//  The original class, still sized by STREAMPARSER_BUFFER_SIZE.
+class StreamParser : public StreamParserN<STREAMPARSER_BUFFER_SIZE> {
+
+public:
+
+	StreamParser(Stream* aIn, char aSop, char aEop, void(*aCallback)(char*)):StreamParserN<STREAMPARSER_BUFFER_SIZE>(aIn, aSop, aEop, aCallback){};
+	StreamParser(Stream* aIn, void(*aCallback)(char*)):StreamParserN<STREAMPARSER_BUFFER_SIZE>(aIn, aCallback){};
+
 };
 
 
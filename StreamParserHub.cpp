@@ -0,0 +1,125 @@
+/*
+
+StreamParserHub  --  Services several StreamParsers round robin out of one
+                     shared buffer arena.
+     Copyright (C) 2017  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "StreamParserHub.h"
+
+
+//  Returns the index of the new link or -1 if we're out of links or arena.
+//  aQuota is the most bytes the link gets to process on each visit.
+int StreamParserHub::addStream(Stream *aIn, char aSop, char aEop,
+		void (*aCallback)(char*), int aBufferSize, uint8_t aQuota) {
+
+	if ((numLinks >= STREAMPARSER_HUB_MAX_LINKS)
+			|| (aBufferSize < 4)
+			|| (arenaUsed + aBufferSize > STREAMPARSER_HUB_ARENA_SIZE)) {
+		return -1;
+	}
+	links[numLinks].attach(aIn, aSop, aEop, aCallback, arena + arenaUsed, aBufferSize);
+	arenaUsed += aBufferSize;
+	quotas[numLinks] = (aQuota == 0) ? 1 : aQuota;
+	return numLinks++;
+}
+
+int StreamParserHub::addStream(Stream *aIn, void (*aCallback)(char*),
+		int aBufferSize, uint8_t aQuota) {
+	return addStream(aIn, '<', '>', aCallback, aBufferSize, aQuota);
+}
+
+//  Visits every link once starting with the one after where the last
+//  round started.  If aMaxMicros runs out the round stops early and the
+//  links that got skipped go first next time.
+void StreamParserHub::run(uint32_t aMaxMicros) {
+
+	uint32_t startTime = micros();
+	uint8_t visited = 0;
+	uint8_t current = nextLink;
+
+	while (visited < numLinks) {
+		if (aMaxMicros && (micros() - startTime >= aMaxMicros)) {
+			break;
+		}
+		if (bulk) {
+			stats[current].bytesServiced += links[current].runBulk(quotas[current]);
+		} else {
+			stats[current].bytesServiced += links[current].run(quotas[current]);
+		}
+		uint16_t left = links[current].inputBacklog();
+		stats[current].backlog = left;
+		if (left > stats[current].maxBacklog) {
+			stats[current].maxBacklog = left;
+		}
+		visited++;
+		if (++current >= numLinks) {
+			current = 0;
+		}
+	}
+	if (visited == numLinks) {
+		// full round, so rotate who goes first
+		current = nextLink + 1;
+		if (current >= numLinks) {
+			current = 0;
+		}
+	}
+	nextLink = current;
+}
+
+StreamParserBase* StreamParserHub::getParser(uint8_t aLink) {
+	if (aLink >= numLinks) {
+		return NULL;
+	}
+	return &links[aLink];
+}
+
+uint8_t StreamParserHub::getNumLinks() {
+	return numLinks;
+}
+
+int StreamParserHub::getArenaFree() {
+	return STREAMPARSER_HUB_ARENA_SIZE - arenaUsed;
+}
+
+void StreamParserHub::setBulk(boolean aBoo) {
+	bulk = aBoo;
+}
+
+void StreamParserHub::setQuota(uint8_t aLink, uint8_t aQuota) {
+	if (aLink < numLinks) {
+		quotas[aLink] = (aQuota == 0) ? 1 : aQuota;
+	}
+}
+
+uint16_t StreamParserHub::getBacklog(uint8_t aLink) {
+	return (aLink < numLinks) ? stats[aLink].backlog : 0;
+}
+
+uint16_t StreamParserHub::getMaxBacklog(uint8_t aLink) {
+	return (aLink < numLinks) ? stats[aLink].maxBacklog : 0;
+}
+
+uint32_t StreamParserHub::getBytesServiced(uint8_t aLink) {
+	return (aLink < numLinks) ? stats[aLink].bytesServiced : 0;
+}
+
+void StreamParserHub::clearStats() {
+	for (uint8_t i = 0; i < numLinks; i++) {
+		stats[i] = StreamParserLinkStats();
+	}
+}
@@ -0,0 +1,85 @@
+/*
+
+StreamParserHub  --  Services several StreamParsers round robin out of one
+                     shared buffer arena.
+     Copyright (C) 2017  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef STREAMPARSERHUB_H_
+#define STREAMPARSERHUB_H_
+
+#include "Arduino.h"
+#include "StreamParser.h"
+
+#ifndef STREAMPARSER_HUB_MAX_LINKS
+#define STREAMPARSER_HUB_MAX_LINKS 3
+#endif
+
+//  Total buffer space shared by all of the links.  Each link takes
+//  only as much as its own largest frame needs.
+#ifndef STREAMPARSER_HUB_ARENA_SIZE
+#define STREAMPARSER_HUB_ARENA_SIZE 128
+#endif
+
+struct StreamParserLinkStats {
+	uint32_t bytesServiced;
+	uint16_t backlog;     // bytes still waiting after the last visit
+	uint16_t maxBacklog;  // worst backlog seen since the last clearStats
+
+	StreamParserLinkStats():bytesServiced(0), backlog(0), maxBacklog(0){};
+};
+
+class StreamParserHub {
+
+private:
+	char arena[STREAMPARSER_HUB_ARENA_SIZE];
+	int arenaUsed;
+
+	StreamParserBase links[STREAMPARSER_HUB_MAX_LINKS];
+	uint8_t quotas[STREAMPARSER_HUB_MAX_LINKS];
+	StreamParserLinkStats stats[STREAMPARSER_HUB_MAX_LINKS];
+
+	uint8_t numLinks;
+	uint8_t nextLink;
+
+	boolean bulk;
+
+public:
+
+	StreamParserHub():arenaUsed(0), numLinks(0), nextLink(0), bulk(false){};
+
+	int addStream(Stream*, char, char, void(*)(char*), int aBufferSize, uint8_t aQuota);
+	int addStream(Stream*, void(*)(char*), int aBufferSize, uint8_t aQuota);
+
+	void run(uint32_t aMaxMicros = 0);
+
+	StreamParserBase* getParser(uint8_t);
+	uint8_t getNumLinks();
+	int getArenaFree();
+
+	void setBulk(boolean);
+	void setQuota(uint8_t, uint8_t);
+
+	uint16_t getBacklog(uint8_t);
+	uint16_t getMaxBacklog(uint8_t);
+	uint32_t getBytesServiced(uint8_t);
+	void clearStats();
+
+};
+
+
+#endif /* STREAMPARSERHUB_H_ */
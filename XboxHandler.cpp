@@ -21,6 +21,19 @@ XboxHandler  --  library that helps to keep track of buttons and states on
      */
 #include "XboxHandler.h"
 
+static uint8_t hexNibble(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return 0;
+}
+
 XboxHandler::XboxHandler(){
 	memset(readUnion.rawBuffer, 0, 14);
 	oldButtonState = 0;
@@ -69,20 +82,32 @@ void XboxHandler::handleIncomingASCII(char* aPacket){
 
 	if(strncmp(aPacket, "140D", 4) == 0){
 
-		uint8_t rawBuf[14];
-
+		// straight into the union, two hex digits a byte, no strtoul
 		for ( uint8_t i = 0; i < 14; i++){
-			char temp[3] = {aPacket[(2*i)], aPacket[1+(2*i)] , 0};
-			rawBuf[i] = strtoul(temp, NULL, HEX);
+			readUnion.rawBuffer[i] = (hexNibble(aPacket[(2*i)]) << 4) | hexNibble(aPacket[1+(2*i)]);
 		}
 
-		memcpy(readUnion.rawBuffer, rawBuf, 14);
-
 		updateData();
 
 	}
 }
 
+//  Takes the whole frame from a raw callback, '<' and all.  The union comes
+//  across byte for byte so there's nothing to convert.
+void XboxHandler::handleIncomingBinary(uint8_t* aFrame){
+
+	if ((aFrame[1] == XBOX_BINARY_CODE) && (aFrame[2] == XBOX_BINARY_FRAME_SIZE)
+			&& (aFrame[3] == 0x14) && (aFrame[4] == 0x0D)) {
+
+		//save old hat state
+		memcpy (oldHatState, readUnion.values.hatValues, 8);
+
+		memcpy(readUnion.rawBuffer, aFrame + 3, XBOX_RAW_BUFFER_SIZE);
+
+		updateData();
+	}
+}
+
 void XboxHandler::updateData() {
 
 	//  Use OR Equal to preserve clicks that haven been read yet
@@ -173,3 +198,20 @@ void XboxHandler::rebuildPacket(char* aBuf){
 	sprintf(aBuf, "%0.4X%0.4X%0.2X%0.2X%0.4X%0.4X%0.4X%0.4X>", 0x140D, readUnion.values.buttonState, readUnion.values.leftTrigger, readUnion.values.rightTrigger, readUnion.values.hatValues[0], readUnion.values.hatValues[1], readUnion.values.hatValues[2], readUnion.values.hatValues[3]);
 
 }
+
+//  Binary version of rebuildPacket, 17 bytes instead of 28 hex characters
+//  plus framing.  aBuf needs XBOX_BINARY_FRAME_SIZE bytes.  Returns the length.
+uint8_t XboxHandler::buildBinaryPacket(uint8_t* aBuf){
+	aBuf[0] = START_OF_PACKET;
+	aBuf[1] = XBOX_BINARY_CODE;
+	aBuf[2] = XBOX_BINARY_FRAME_SIZE;
+	memcpy(aBuf + 3, readUnion.rawBuffer, XBOX_RAW_BUFFER_SIZE);
+	// check bytes the same way the ascii version writes them
+	aBuf[3] = 0x14;
+	aBuf[4] = 0x0D;
+	return XBOX_BINARY_FRAME_SIZE;
+}
+
+const ControllerUnion& XboxHandler::getControllerUnion(){
+	return readUnion;
+}
@@ -74,6 +74,7 @@ public:
 
 	void handleIncoming(uint8_t*);
 	void handleIncomingASCII(char*);
+	void handleIncomingBinary(uint8_t*);
 	void updateData();
 
 	boolean isClicked(ButtonMaskEnum);
@@ -85,6 +86,9 @@ public:
 	boolean newDataAvailable();
 
 	void rebuildPacket(char*);
+	uint8_t buildBinaryPacket(uint8_t*);
+
+	const ControllerUnion& getControllerUnion();
 
 
 };
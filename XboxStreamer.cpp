@@ -0,0 +1,115 @@
+/*
+
+XboxStreamer  --  sends controller frames from an XboxHandler only when
+                  something actually changed, plus a slow keepalive.
+     Copyright (C) 2017  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "XboxStreamer.h"
+
+XboxStreamer::XboxStreamer(){
+	memset(lastSent.rawBuffer, 0, XBOX_RAW_BUFFER_SIZE);
+	hasSent = false;
+	lastSendTime = 0;
+	hatThreshold = DEFAULT_HAT_THRESHOLD;
+	keepaliveInterval = DEFAULT_KEEPALIVE_INTERVAL;
+	sentCount = 0;
+	suppressedCount = 0;
+}
+
+XboxStreamer::XboxStreamer(uint16_t aThreshold, uint32_t aKeepalive){
+	memset(lastSent.rawBuffer, 0, XBOX_RAW_BUFFER_SIZE);
+	hasSent = false;
+	lastSendTime = 0;
+	hatThreshold = aThreshold;
+	keepaliveInterval = aKeepalive;
+	sentCount = 0;
+	suppressedCount = 0;
+}
+
+//  Anything inside the deadband counts as centered, so stick noise around
+//  the middle never sends anything.  Coming back to center always does.
+//  Widened before abs since -32768 doesn't have a 16 bit magnitude on AVR.
+boolean XboxStreamer::hatMoved(int16_t aNew, int16_t aOld){
+	int32_t newVal = aNew;
+	int32_t oldVal = aOld;
+	if (abs(newVal) < DEFAULT_DEADBAND) {
+		newVal = 0;
+	}
+	if (abs(oldVal) < DEFAULT_DEADBAND) {
+		oldVal = 0;
+	}
+	if ((newVal == 0) != (oldVal == 0)) {
+		return true;
+	}
+	return (abs(newVal - oldVal) > hatThreshold);
+}
+
+//  Compared against the last frame that actually went out, not the last
+//  one we looked at, so slow drift still adds up and gets sent.
+boolean XboxStreamer::hasChanged(const ControllerUnion &aState){
+	if (!hasSent) {
+		return true;
+	}
+	if ((aState.values.buttonState != lastSent.values.buttonState)
+			|| (aState.values.leftTrigger != lastSent.values.leftTrigger)
+			|| (aState.values.rightTrigger != lastSent.values.rightTrigger)) {
+		return true;
+	}
+	for (uint8_t i = 0; i < NUMBER_HATS; i++) {
+		if (hatMoved(aState.values.hatValues[i], lastSent.values.hatValues[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//  Writes a binary frame into aBuf and returns its length if it's worth
+//  sending, otherwise returns 0.  aBuf needs XBOX_BINARY_FRAME_SIZE bytes.
+uint8_t XboxStreamer::encode(XboxHandler &aHandler, uint8_t *aBuf){
+	const ControllerUnion &state = aHandler.getControllerUnion();
+	if (!hasChanged(state) && (millis() - lastSendTime < keepaliveInterval)) {
+		suppressedCount++;
+		return 0;
+	}
+	memcpy(lastSent.rawBuffer, state.rawBuffer, XBOX_RAW_BUFFER_SIZE);
+	hasSent = true;
+	lastSendTime = millis();
+	sentCount++;
+	return aHandler.buildBinaryPacket(aBuf);
+}
+
+//  Next encode sends no matter what, like after the link comes back.
+void XboxStreamer::forceNext(){
+	hasSent = false;
+}
+
+void XboxStreamer::setHatThreshold(uint16_t aThreshold){
+	hatThreshold = aThreshold;
+}
+
+void XboxStreamer::setKeepaliveInterval(uint32_t aInterval){
+	keepaliveInterval = aInterval;
+}
+
+uint32_t XboxStreamer::getSentCount(){
+	return sentCount;
+}
+
+uint32_t XboxStreamer::getSuppressedCount(){
+	return suppressedCount;
+}
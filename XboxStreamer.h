@@ -0,0 +1,68 @@
+/*
+
+XboxStreamer  --  sends controller frames from an XboxHandler only when
+                  something actually changed, plus a slow keepalive.
+     Copyright (C) 2017  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef XBOXSTREAMER_H_
+#define XBOXSTREAMER_H_
+
+#include "Arduino.h"
+#include "XboxHandler.h"
+
+#define DEFAULT_HAT_THRESHOLD 512
+#define DEFAULT_KEEPALIVE_INTERVAL 1000
+
+//  Every frame it sends is a full binary frame, so the robot side just
+//  feeds them to XboxHandler::handleIncomingBinary and always has the
+//  whole state.  Nothing extra is needed to put it back together.
+class XboxStreamer {
+
+private:
+
+	ControllerUnion lastSent;
+	boolean hasSent;
+	uint32_t lastSendTime;
+
+	uint16_t hatThreshold;
+	uint32_t keepaliveInterval;
+
+	uint32_t sentCount;
+	uint32_t suppressedCount;
+
+	boolean hatMoved(int16_t, int16_t);
+
+public:
+
+	XboxStreamer();
+	XboxStreamer(uint16_t aThreshold, uint32_t aKeepalive);
+
+	boolean hasChanged(const ControllerUnion&);
+	uint8_t encode(XboxHandler&, uint8_t*);
+	void forceNext();
+
+	void setHatThreshold(uint16_t);
+	void setKeepaliveInterval(uint32_t);
+
+	uint32_t getSentCount();
+	uint32_t getSuppressedCount();
+
+};
+
+
+#endif /* XBOXSTREAMER_H_ */
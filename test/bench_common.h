@@ -0,0 +1,59 @@
+/*
+
+bench_common  --  Wall clock timing and percentiles for the benchmarks.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef BENCH_COMMON_H_
+#define BENCH_COMMON_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+//  Real time, not the mock clock
+class BenchTimer {
+
+private:
+	std::chrono::steady_clock::time_point start;
+
+public:
+
+	BenchTimer():start(std::chrono::steady_clock::now()){};
+
+	double seconds() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+};
+
+//  Nearest rank, 100 gives the max.  0 if there's nothing to look at.
+template<class T>
+T percentile(std::vector<T> aValues, int aPercent) {
+	if (aValues.empty()) {
+		return 0;
+	}
+	std::sort(aValues.begin(), aValues.end());
+	size_t rank = (aValues.size() * aPercent + 99) / 100;
+	if (rank < 1) {
+		rank = 1;
+	}
+	return aValues[rank - 1];
+}
+
+#endif /* BENCH_COMMON_H_ */
@@ -0,0 +1,114 @@
+/*
+
+fec_bench  --  What the Reed-Solomon FEC costs in CPU for each byte of
+               radio payload, encoding and decoding clean and damaged
+               packets, for a few packet sizes and parity counts.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "ReedSolomon.h"
+#include "fuzz_common.h"
+#include "bench_common.h"
+
+#include <vector>
+
+//  Enough packets for steady numbers without the whole run taking long
+#define BENCH_BYTES 200000UL
+
+static int failures = 0;
+
+//  ns per payload byte, best of three.  aErrors bad bytes go into each
+//  packet's copy before it's decoded, -1 just encodes.
+static double timeOne(ReedSolomon &aRs, uint8_t aLength, int aErrors) {
+	uint8_t parity = aRs.getParity();
+	uint32_t packets = BENCH_BYTES / aLength;
+	FuzzRandom rng(aLength * 31 + parity + aErrors);
+
+	// a few different packets so it isn't timing one lucky one
+	std::vector<std::vector<uint8_t> > codewords(16);
+	for (size_t c = 0; c < codewords.size(); c++) {
+		codewords[c].resize(aLength + parity);
+		for (uint8_t i = 0; i < aLength; i++) {
+			codewords[c][i] = rng.below(256);
+		}
+		aRs.encode(&codewords[c][0], aLength, &codewords[c][aLength]);
+	}
+	std::vector<std::vector<uint8_t> > damaged(codewords);
+	for (size_t c = 0; c < damaged.size() && aErrors > 0; c++) {
+		for (int e = 0; e < aErrors; e++) {
+			// could land on the same byte twice, fewer errors is still fine to time
+			damaged[c][rng.below(aLength + parity)] ^= 1 + rng.below(255);
+		}
+	}
+
+	double best = 0;
+	for (int rep = 0; rep < 3; rep++) {
+		uint8_t work[255];
+		BenchTimer timer;
+		for (uint32_t p = 0; p < packets; p++) {
+			const std::vector<uint8_t> &c = damaged[p % damaged.size()];
+			if (aErrors < 0) {
+				aRs.encode(&c[0], aLength, work);
+			} else {
+				memcpy(work, &c[0], aLength + parity);
+				if (aRs.decode(work, aLength + parity) < 0) {
+					failures++;
+				}
+			}
+		}
+		double seconds = timer.seconds();
+		if ((best == 0) || (seconds < best)) {
+			best = seconds;
+		}
+		if ((aErrors >= 0) && (memcmp(work, &codewords[(packets - 1) % codewords.size()][0], aLength) != 0)) {
+			failures++;
+		}
+	}
+	return best * 1e9 / ((double) packets * aLength);
+}
+
+int main() {
+	static const uint8_t parities[] = { 4, 8, 16 };
+	static const uint8_t lengths[] = { 16, 32, 64, 128, 200 };
+
+	printf("ReedSolomon CPU cost, ns per payload byte on this machine, best of 3\n");
+	printf("RadioCommon sends RADIO_FEC_PARITY (8 unless it's overridden) parity bytes.\n");
+	printf("Decoding stops after the syndromes when nothing's wrong, bad bytes cost more.\n");
+	for (size_t p = 0; p < sizeof(parities) / sizeof(parities[0]); p++) {
+		ReedSolomon rs(parities[p]);
+		int fixable = parities[p] / 2;
+		printf("\n%u parity bytes, fixes up to %d\n", parities[p], fixable);
+		printf("  %8s %9s %9s %9s %9s %9s\n", "payload", "encode", "clean", "1 bad", "half", "us/packet");
+		for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+			uint8_t len = lengths[l];
+			double encode = timeOne(rs, len, -1);
+			double clean = timeOne(rs, len, 0);
+			double one = timeOne(rs, len, 1);
+			double half = timeOne(rs, len, fixable);
+			// encode and a clean decode, what every packet pays
+			printf("  %8u %9.1f %9.1f %9.1f %9.1f %9.2f\n", len, encode, clean, one, half,
+					(encode + clean) * len / 1000);
+		}
+	}
+
+	if (failures) {
+		printf("\nfec_bench: %d packets didn't decode back\n", failures);
+		return 1;
+	}
+	return 0;
+}
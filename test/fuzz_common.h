@@ -0,0 +1,134 @@
+/*
+
+fuzz_common  --  Repeatable random byte streams of good, bad and broken
+                 frames for the parser tests and benchmarks.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef FUZZ_COMMON_H_
+#define FUZZ_COMMON_H_
+
+#include "Arduino.h"
+#include <RobotSharedDefines.h>
+#include <string>
+
+#define GUARD_SIZE 16
+#define GUARD_BYTE ((char) 0xA5)
+
+//  xorshift, so a seed always gives the same stream on any machine
+class FuzzRandom {
+
+private:
+	uint32_t state;
+
+public:
+
+	FuzzRandom(uint32_t aSeed):state(aSeed * 2654435761UL + 1){};
+
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+	uint32_t below(uint32_t aLimit) {
+		return next() % aLimit;
+	}
+	char printable() {
+		// anything but the markers
+		char c;
+		do {
+			c = ' ' + below(95);
+		} while (c == START_OF_PACKET || c == END_OF_PACKET);
+		return c;
+	}
+
+};
+
+//  aPieces worth of ascii frames, raw frames, noise and frames cut off
+//  partway, for a parser with an aBufferSize byte buffer.  With
+//  aWellFormed every frame fits the buffer, raw lengths are sane and the
+//  noise has no markers, which is what the string and frame
+//  command parsers both promise to handle the same way.
+inline std::string randomStream(FuzzRandom &rng, int aBufferSize, int aPieces, boolean aWellFormed) {
+	static const char *commands[] = { "A12", "B3,-4", "B2147483647,1", "B99999999999,1",
+			"CX", "CXY", "C1", "7", "B", "Z" };
+	std::string s;
+	for (int p = 0; p < aPieces; p++) {
+		switch (rng.below(6)) {
+		case 0: {
+			// ascii frame, sometimes too long for the buffer
+			int limit = (aWellFormed) ? aBufferSize - 3 : 2 * aBufferSize;
+			int len = rng.below(limit + 1);
+			s += START_OF_PACKET;
+			for (int i = 0; i < len; i++) {
+				s += rng.printable();
+			}
+			s += END_OF_PACKET;
+			break;
+		}
+		case 1: {
+			// raw frame, with a length that might not fit
+			uint8_t len;
+			if (aWellFormed) {
+				len = 4 + rng.below(aBufferSize - 4);
+			} else if (rng.below(4) == 0) {
+				len = rng.below(256);
+			} else {
+				len = 3 + rng.below(aBufferSize);
+			}
+			s += START_OF_PACKET;
+			s += (char) (0x11 + rng.below(4));
+			s += (char) len;
+			for (int i = 3; i < len; i++) {
+				s += (char) rng.below(256);
+			}
+			break;
+		}
+		case 2: {
+			// line noise
+			int len = 1 + rng.below(20);
+			for (int i = 0; i < len; i++) {
+				char c = (char) rng.below(256);
+				if (aWellFormed && ((c == START_OF_PACKET) || (c == END_OF_PACKET))) {
+					c = ' ';
+				}
+				s += c;
+			}
+			break;
+		}
+		case 3: {
+			// cut off before the end marker, the next start marker restarts.
+			// A bare start marker could pick up a raw code from the noise after it.
+			int len = (aWellFormed) ? 1 + rng.below(aBufferSize - 3) : rng.below(aBufferSize + 1);
+			s += START_OF_PACKET;
+			for (int i = 0; i < len; i++) {
+				s += rng.printable();
+			}
+			break;
+		}
+		default:
+			s += START_OF_PACKET;
+			s += commands[rng.below(sizeof(commands) / sizeof(commands[0]))];
+			s += END_OF_PACKET;
+			break;
+		}
+	}
+	return s;
+}
+
+#endif /* FUZZ_COMMON_H_ */
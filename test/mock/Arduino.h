@@ -0,0 +1,138 @@
+/*
+
+Arduino.h  --  Just enough of the Arduino core to build the library on a
+               desktop for the test and benchmark programs in test/.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef MOCK_ARDUINO_H_
+#define MOCK_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+//  Time doesn't pass on its own here.  Whoever is running the test moves
+//  the clock along, and delay() and anything else that would block on
+//  the real board moves it too.
+extern uint32_t mockMicros;
+
+inline uint32_t micros() {
+	return mockMicros;
+}
+inline uint32_t millis() {
+	return mockMicros / 1000;
+}
+inline void mockAdvance(uint32_t aMicros) {
+	mockMicros += aMicros;
+}
+inline void delay(uint32_t aMillis) {
+	mockAdvance(aMillis * 1000);
+}
+inline void delayMicroseconds(uint32_t aMicros) {
+	mockAdvance(aMicros);
+}
+
+inline void pinMode(uint8_t, uint8_t) {
+}
+inline void digitalWrite(uint8_t, uint8_t) {
+}
+
+class Print {
+
+public:
+
+	virtual ~Print() {
+	}
+
+	virtual size_t write(uint8_t) = 0;
+	virtual size_t write(const uint8_t *aBuf, size_t aLen) {
+		for (size_t i = 0; i < aLen; i++) {
+			write(aBuf[i]);
+		}
+		return aLen;
+	}
+
+	size_t print(const char *s) {
+		return write((const uint8_t*) s, strlen(s));
+	}
+	size_t print(char c) {
+		return write((uint8_t) c);
+	}
+	size_t print(long n, int aBase = DEC) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), (aBase == HEX) ? "%lX" : "%ld", n);
+		return print(buf);
+	}
+	size_t print(unsigned long n, int aBase = DEC) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), (aBase == HEX) ? "%lX" : "%lu", n);
+		return print(buf);
+	}
+	size_t print(int n, int aBase = DEC) {
+		return print((long) n, aBase);
+	}
+	size_t print(unsigned int n, int aBase = DEC) {
+		return print((unsigned long) n, aBase);
+	}
+	size_t println(const char *s) {
+		return print(s) + print("\r\n");
+	}
+
+};
+
+//  readBytes here never waits on a timeout, it stops when read() runs dry.
+class Stream : public Print {
+
+public:
+
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+
+	virtual size_t readBytes(char *aBuf, size_t aLen) {
+		size_t count = 0;
+		while (count < aLen) {
+			int c = read();
+			if (c < 0) {
+				break;
+			}
+			aBuf[count++] = (char) c;
+		}
+		return count;
+	}
+	size_t readBytes(uint8_t *aBuf, size_t aLen) {
+		return readBytes((char*) aBuf, aLen);
+	}
+
+};
+
+#endif /* MOCK_ARDUINO_H_ */
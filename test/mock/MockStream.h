@@ -0,0 +1,105 @@
+/*
+
+MockStream  --  A Stream that plays back a recorded or made up byte
+                stream, optionally paced like a serial line.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef MOCKSTREAM_H_
+#define MOCKSTREAM_H_
+
+#include "Arduino.h"
+#include <string>
+
+//  With a baud rate set the bytes only show up as fast as a real UART
+//  would deliver them on the mock clock, counting from when setInput was
+//  called.  With maxAvailable set available() never reports more than
+//  that, like a small hardware FIFO.  Anything written is kept in output.
+class MockStream : public Stream {
+
+private:
+	std::string input;
+	size_t pos;
+	uint32_t startMicros;
+	uint32_t byteMicros;   // 0 for everything there at once
+	int maxAvailable;      // 0 for no limit
+
+	size_t arrived() {
+		if (byteMicros == 0) {
+			return input.size();
+		}
+		size_t n = (micros() - startMicros) / byteMicros;
+		return (n < input.size()) ? n : input.size();
+	}
+
+public:
+
+	std::string output;
+
+	MockStream():pos(0), startMicros(0), byteMicros(0), maxAvailable(0){};
+
+	void setInput(const std::string &aInput) {
+		input = aInput;
+		pos = 0;
+		startMicros = micros();
+	}
+	void setBaud(uint32_t aBaud) {
+		// 10 bits a byte with the start and stop bits
+		byteMicros = (aBaud) ? (10000000UL / aBaud) : 0;
+	}
+	void setMaxAvailable(int aMax) {
+		maxAvailable = aMax;
+	}
+
+	//  When byte n of the input showed up on the mock clock
+	uint32_t arrivalMicros(size_t n) {
+		return startMicros + ((n + 1) * byteMicros);
+	}
+	size_t consumed() {
+		return pos;
+	}
+	boolean finished() {
+		return pos >= input.size();
+	}
+
+	int available() {
+		int n = arrived() - pos;
+		if (maxAvailable && (n > maxAvailable)) {
+			n = maxAvailable;
+		}
+		return n;
+	}
+	int read() {
+		if (pos >= arrived()) {
+			return -1;
+		}
+		return (uint8_t) input[pos++];
+	}
+	int peek() {
+		if (pos >= arrived()) {
+			return -1;
+		}
+		return (uint8_t) input[pos];
+	}
+	size_t write(uint8_t c) {
+		output += (char) c;
+		return 1;
+	}
+
+};
+
+#endif /* MOCKSTREAM_H_ */
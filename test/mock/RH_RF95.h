@@ -0,0 +1,106 @@
+/*
+
+RH_RF95.h  --  A do nothing stand in for RadioHead's driver so RadioCommon
+               links on the desktop.  Sends go nowhere and nothing ever
+               comes in.  SimRadio is the one that models the air.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef MOCK_RH_RF95_H_
+#define MOCK_RH_RF95_H_
+
+#include "Arduino.h"
+
+#define RH_RF95_HEADER_LEN 4
+#define RH_RF95_MAX_PAYLOAD_LEN 255
+#define RH_RF95_MAX_MESSAGE_LEN (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN)
+
+class RHGenericDriver {
+
+public:
+
+	typedef enum {
+		RHModeInitialising = 0,
+		RHModeSleep,
+		RHModeIdle,
+		RHModeTx,
+		RHModeRx,
+		RHModeCad
+	} RHMode;
+
+};
+
+class RH_RF95 : public RHGenericDriver {
+
+public:
+
+	typedef enum {
+		Bw125Cr45Sf128 = 0,
+		Bw500Cr45Sf128,
+		Bw31_25Cr48Sf512,
+		Bw125Cr48Sf4096,
+		Bw125Cr45Sf2048
+	} ModemConfigChoice;
+
+	RH_RF95(uint8_t = 0, uint8_t = 0) {
+	}
+
+	bool init() {
+		return true;
+	}
+	bool available() {
+		return false;
+	}
+	bool recv(uint8_t*, uint8_t *aLen) {
+		*aLen = 0;
+		return false;
+	}
+	bool send(const uint8_t*, uint8_t) {
+		return true;
+	}
+	bool waitPacketSent() {
+		return true;
+	}
+	RHMode mode() {
+		return RHModeIdle;
+	}
+	bool setFrequency(float) {
+		return true;
+	}
+	void setTxPower(int8_t, bool = false) {
+	}
+	bool setModemConfig(ModemConfigChoice) {
+		return true;
+	}
+	void setSignalBandwidth(long) {
+	}
+	void setSpreadingFactor(uint8_t) {
+	}
+	void setCodingRate4(uint8_t) {
+	}
+	void setPayloadCRC(bool) {
+	}
+	int16_t lastRssi() {
+		return 0;
+	}
+	int lastSNR() {
+		return 0;
+	}
+
+};
+
+#endif /* MOCK_RH_RF95_H_ */
@@ -0,0 +1 @@
+//  Nothing in the host build talks SPI, RadioCommon.h just includes it.
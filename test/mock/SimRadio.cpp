@@ -0,0 +1,322 @@
+/*
+
+SimRadio  --  Stand in for RH_RF95 on the host.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "SimRadio.h"
+#include <math.h>
+
+//  Transmissions stay around this long after they end so later ones can
+//  be checked against them.  Longer than any packet's airtime.
+#define SIM_HISTORY_MICROS 20000000UL
+
+//  A register read or two
+#define SIM_SPI_MICROS 20
+
+SimAir::SimAir() {
+	lossProbability = 0;
+	byteErrorProbability = 0;
+	rssi = -80;
+	state = 2463534242UL;
+}
+
+void SimAir::attach(SimRadio *aRadio) {
+	radios.push_back(aRadio);
+}
+
+//  xorshift so a run always comes out the same
+uint32_t SimAir::random() {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+double SimAir::uniform() {
+	return random() / 4294967296.0;
+}
+
+int16_t SimAir::snrFor(int16_t aRssi, uint32_t aBandwidth) {
+	double noise = -174.0 + (10.0 * log10((double) aBandwidth)) + 6.0;
+	return (int16_t) lround(aRssi - noise);
+}
+
+//  SF7 -7.5dB and 2.5dB more for each step up, SF12 -20dB
+int16_t SimAir::snrFloor10(uint8_t aSf) {
+	return -75 - (25 * ((int16_t) aSf - 7));
+}
+
+void SimAir::transmit(SimRadio *aFrom, const uint8_t *aData, uint8_t aLen, uint32_t aAirtime) {
+	Transmission t;
+	t.from = aFrom;
+	t.start = micros();
+	t.end = t.start + aAirtime;
+	t.sf = aFrom->sf;
+	t.bw = aFrom->bw;
+	t.crc = aFrom->crc;
+	t.data.assign(aData, aData + aLen);
+	t.delivered = false;
+	history.push_back(t);
+}
+
+boolean SimAir::overlaps(const Transmission &a, const Transmission &b) {
+	return ((int32_t) (a.start - b.end) < 0) && ((int32_t) (b.start - a.end) < 0);
+}
+
+//  Hands every packet that has finished to everyone but its sender
+void SimAir::update() {
+	uint32_t now = micros();
+	for (size_t i = 0; i < history.size(); i++) {
+		Transmission &t = history[i];
+		if (t.delivered || ((int32_t) (now - t.end) < 0)) {
+			continue;
+		}
+		t.delivered = true;
+		for (size_t r = 0; r < radios.size(); r++) {
+			if (radios[r] != t.from) {
+				deliver(t, radios[r]);
+			}
+		}
+	}
+	while (!history.empty() && history[0].delivered
+			&& ((uint32_t) (now - history[0].end) > SIM_HISTORY_MICROS)) {
+		history.erase(history.begin());
+	}
+}
+
+void SimAir::deliver(const Transmission &aPacket, SimRadio *aTo) {
+	SimRadio::Counters &c = aTo->counters;
+	for (size_t i = 0; i < history.size(); i++) {
+		const Transmission &other = history[i];
+		if ((&other == &aPacket) || !overlaps(other, aPacket)) {
+			continue;
+		}
+		if (other.from == aTo) {
+			c.halfDuplex++;
+			return;
+		}
+		// with only one other radio this never happens, but a third one could
+		c.collisions++;
+		return;
+	}
+	if ((aTo->sf != aPacket.sf) || (aTo->bw != aPacket.bw)) {
+		c.wrongModem++;
+		return;
+	}
+	if (uniform() < lossProbability) {
+		c.lost++;
+		return;
+	}
+	// a few dB of fading either way, roughly normal
+	double fade = 3.0 * (uniform() + uniform() + uniform() - 1.5);
+	int16_t packetRssi = (int16_t) lround(rssi + fade);
+	int16_t snr = snrFor(packetRssi, aPacket.bw);
+	if (snr * 10 < snrFloor10(aPacket.sf)) {
+		c.tooWeak++;
+		return;
+	}
+	std::vector<uint8_t> data = aPacket.data;
+	boolean damaged = false;
+	if (byteErrorProbability > 0) {
+		for (size_t i = 0; i < data.size(); i++) {
+			if (uniform() < byteErrorProbability) {
+				data[i] ^= (uint8_t) (1 + (random() % 255));
+				damaged = true;
+			}
+		}
+	}
+	if (damaged) {
+		if (aPacket.crc) {
+			c.crcDrops++;
+			return;
+		}
+		c.damaged++;
+	}
+	if (aTo->rxReady) {
+		c.overwritten++;
+	}
+	memcpy(aTo->rxBuffer, &data[0], data.size());
+	aTo->rxLength = data.size();
+	aTo->rxReady = true;
+	aTo->rxRssi = packetRssi;
+	aTo->rxSnr = snr;
+	c.received++;
+}
+
+SimRadio::SimRadio() {
+	air = NULL;
+	transmitting = false;
+	txStart = 0;
+	txEnd = 0;
+	rxLength = 0;
+	rxReady = false;
+	rxRssi = 0;
+	rxSnr = 0;
+	memset(&counters, 0, sizeof(counters));
+	init();
+}
+
+void SimRadio::attach(SimAir *aAir) {
+	air = aAir;
+	air->attach(this);
+}
+
+//  What RadioHead leaves it at, Bw125Cr45Sf128 with the CRC on
+bool SimRadio::init() {
+	setModemConfig(Bw125Cr45Sf128);
+	crc = true;
+	return true;
+}
+
+void SimRadio::modem(uint8_t aSf, uint32_t aBw, uint8_t aCr, boolean aLowRate) {
+	sf = aSf;
+	bw = aBw;
+	cr = aCr;
+	lowRate = aLowRate;
+}
+
+//  Low data rate optimize comes from each preset's register values
+bool SimRadio::setModemConfig(ModemConfigChoice aChoice) {
+	switch (aChoice) {
+	case Bw500Cr45Sf128:
+		modem(7, 500000, 5, false);
+		break;
+	case Bw31_25Cr48Sf512:
+		modem(9, 31250, 8, false);
+		break;
+	case Bw125Cr48Sf4096:
+		modem(12, 125000, 8, true);
+		break;
+	case Bw125Cr45Sf2048:
+		modem(11, 125000, 5, false);
+		break;
+	case Bw125Cr45Sf128:
+	default:
+		modem(7, 125000, 5, false);
+		break;
+	}
+	return true;
+}
+
+//  Set by hand RadioHead turns low data rate on past 16ms a symbol
+void SimRadio::setSignalBandwidth(long aBw) {
+	bw = aBw;
+	lowRate = ((1000000.0 * (1 << sf)) / bw) > 16000;
+}
+
+void SimRadio::setSpreadingFactor(uint8_t aSf) {
+	sf = aSf;
+	lowRate = ((1000000.0 * (1 << sf)) / bw) > 16000;
+}
+
+void SimRadio::setCodingRate4(uint8_t aCr) {
+	cr = aCr;
+}
+
+void SimRadio::setPayloadCRC(bool aOn) {
+	crc = aOn;
+}
+
+bool SimRadio::setFrequency(float) {
+	return true;
+}
+
+void SimRadio::setTxPower(int8_t, bool) {
+}
+
+//  Semtech's formula, explicit header and RadioHead's 8 symbol preamble
+uint32_t SimRadio::airtime(uint8_t aLen) {
+	double symbol = (1000000.0 * (1 << sf)) / bw;
+	int bits = (8 * (aLen + RADIO_HEADER_LEN)) - (4 * sf) + 28 + ((crc) ? 16 : 0);
+	double blocks = ceil((double) bits / (4 * (sf - ((lowRate) ? 2 : 0))));
+	if (blocks < 0) {
+		blocks = 0;
+	}
+	double symbols = 8 + 4.25 + 8 + (blocks * cr);
+	return (uint32_t) (symbols * symbol);
+}
+
+//  Like RadioHead's, waits out the packet before it first
+bool SimRadio::send(const uint8_t *aData, uint8_t aLen) {
+	if (aLen > RADIO_MAX_MESSAGE_LEN) {
+		return false;
+	}
+	waitPacketSent();
+	transmitting = true;
+	txStart = micros();
+	txEnd = txStart + airtime(aLen);
+	counters.sent++;
+	if (air) {
+		air->transmit(this, aData, aLen, txEnd - txStart);
+	}
+	return true;
+}
+
+//  Blocks on the mock clock until the packet is out.  Even with nothing
+//  to wait on a real one spends a little while asking over SPI, and a
+//  loop waiting on something else would never see time pass without it.
+bool SimRadio::waitPacketSent() {
+	if (transmitting && ((int32_t) (txEnd - micros()) > 0)) {
+		mockMicros = txEnd;
+	} else {
+		mockAdvance(SIM_SPI_MICROS);
+	}
+	mode();
+	return true;
+}
+
+SimRadio::RHMode SimRadio::mode() {
+	if (air) {
+		air->update();
+	}
+	if (transmitting && ((int32_t) (micros() - txEnd) >= 0)) {
+		transmitting = false;
+	}
+	return (transmitting) ? RHModeTx : RHModeRx;
+}
+
+bool SimRadio::available() {
+	if (mode() == RHModeTx) {
+		return false;
+	}
+	return rxReady;
+}
+
+bool SimRadio::recv(uint8_t *aBuf, uint8_t *aLen) {
+	if (!available()) {
+		return false;
+	}
+	if (*aLen > rxLength) {
+		*aLen = rxLength;
+	}
+	memcpy(aBuf, rxBuffer, *aLen);
+	rxReady = false;
+	return true;
+}
+
+int16_t SimRadio::lastRssi() {
+	return rxRssi;
+}
+
+int SimRadio::lastSNR() {
+	return rxSnr;
+}
+
+const SimRadio::Counters& SimRadio::getCounters() {
+	return counters;
+}
@@ -0,0 +1,171 @@
+/*
+
+SimRadio  --  Stand in for RH_RF95 on the host.  Packets take as long on
+              the simulated air as they would on a real SX1276, a radio
+              can't hear while it's sending, and the channel between them
+              loses and damages packets as configured.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#ifndef SIMRADIO_H_
+#define SIMRADIO_H_
+
+#include "Arduino.h"
+#include <vector>
+
+//  Same as RadioHead, 255 byte FIFO less its 4 byte header
+#define RADIO_HEADER_LEN 4
+#define RADIO_MAX_MESSAGE_LEN (255 - RADIO_HEADER_LEN)
+
+class SimRadio;
+
+//  What every radio on the channel sees.  Time is the mock clock.
+class SimAir {
+
+public:
+
+	// what the channel does to a packet
+	double lossProbability;       // lost outright, fading, someone walked by...
+	double byteErrorProbability;  // each byte that gets through
+	int16_t rssi;                 // mean, every packet gets a few dB either way
+
+	SimAir();
+
+	void attach(SimRadio*);
+	void transmit(SimRadio*, const uint8_t*, uint8_t, uint32_t);
+	void update();
+
+	//  SNR a packet at aRssi would have with aBandwidth, from the thermal
+	//  noise floor and the SX1276's 6dB noise figure
+	static int16_t snrFor(int16_t, uint32_t);
+	//  The lowest SNR a spreading factor still demodulates, times 10
+	static int16_t snrFloor10(uint8_t);
+
+	uint32_t random();
+
+private:
+
+	struct Transmission {
+		SimRadio *from;
+		uint32_t start;
+		uint32_t end;
+		uint8_t sf;
+		uint32_t bw;
+		boolean crc;
+		std::vector<uint8_t> data;
+		boolean delivered;
+	};
+
+	std::vector<SimRadio*> radios;
+	std::vector<Transmission> history;
+	uint32_t state;
+
+	boolean overlaps(const Transmission&, const Transmission&);
+	void deliver(const Transmission&, SimRadio*);
+	double uniform();
+
+};
+
+class SimRadio {
+
+public:
+
+	typedef enum {
+		RHModeInitialising = 0,
+		RHModeSleep,
+		RHModeIdle,
+		RHModeTx,
+		RHModeRx,
+		RHModeCad
+	} RHMode;
+
+	typedef enum {
+		Bw125Cr45Sf128 = 0,
+		Bw500Cr45Sf128,
+		Bw31_25Cr48Sf512,
+		Bw125Cr48Sf4096,
+		Bw125Cr45Sf2048
+	} ModemConfigChoice;
+
+	//  What happened to the packets sent to this one
+	struct Counters {
+		uint32_t sent;
+		uint32_t received;
+		uint32_t lost;           // the channel's loss probability
+		uint32_t tooWeak;        // SNR under the spreading factor's floor
+		uint32_t halfDuplex;     // we were sending at the time
+		uint32_t collisions;     // someone else was sending at the time
+		uint32_t wrongModem;     // the two ends weren't on the same settings
+		uint32_t crcDrops;       // damaged with the CRC on
+		uint32_t damaged;        // damaged and handed up anyway, CRC off
+		uint32_t overwritten;    // never read before the next one came in
+	};
+
+	SimRadio();
+
+	void attach(SimAir *aAir);
+
+	// RH_RF95's interface, the parts RadioCommon uses
+	bool init();
+	bool available();
+	bool recv(uint8_t*, uint8_t*);
+	bool send(const uint8_t*, uint8_t);
+	bool waitPacketSent();
+	RHMode mode();
+	bool setFrequency(float);
+	void setTxPower(int8_t, bool = false);
+	bool setModemConfig(ModemConfigChoice);
+	void setSignalBandwidth(long);
+	void setSpreadingFactor(uint8_t);
+	void setCodingRate4(uint8_t);
+	void setPayloadCRC(bool);
+	int16_t lastRssi();
+	int lastSNR();
+
+	//  Microseconds on the air for aLen bytes of payload on the current settings
+	uint32_t airtime(uint8_t);
+
+	const Counters& getCounters();
+
+private:
+
+	friend class SimAir;
+
+	SimAir *air;
+	uint8_t sf;
+	uint32_t bw;
+	uint8_t cr;
+	boolean lowRate;
+	boolean crc;
+
+	boolean transmitting;
+	uint32_t txStart;
+	uint32_t txEnd;
+
+	uint8_t rxBuffer[RADIO_MAX_MESSAGE_LEN];
+	uint8_t rxLength;
+	boolean rxReady;
+	int16_t rxRssi;
+	int rxSnr;
+
+	Counters counters;
+
+	void modem(uint8_t, uint32_t, uint8_t, boolean);
+
+};
+
+#endif /* SIMRADIO_H_ */
@@ -0,0 +1,222 @@
+/*
+
+parser_bench  --  How fast the StreamParser framing runs on the desktop,
+                  how long frames wait for their callback behind a busy
+                  main loop, and how it copes with a corrupted line.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "MockStream.h"
+#include "StreamParser.h"
+#include "fuzz_common.h"
+#include "bench_common.h"
+
+#include <string>
+#include <vector>
+
+//  Traffic like the base station sends the robot: short commands, the
+//  ascii controller frame and now and then the binary one.
+static std::string recordedTraffic(int aFrames, std::vector<size_t> *aEnds) {
+	static const char *commands[] = { "<A1500>", "<B1200>", "<C900>", "<DM1>", "<S,0,0>" };
+	static const char xboxAscii[] = "<140D00000000000000000000000000>";
+	FuzzRandom rng(42);
+	std::string s;
+	for (int i = 0; i < aFrames; i++) {
+		uint32_t pick = rng.below(10);
+		if (pick < 5) {
+			s += commands[rng.below(5)];
+		} else if (pick < 9) {
+			s += xboxAscii;
+		} else {
+			s += START_OF_PACKET;
+			s += (char) XBOX_BINARY_CODE;
+			s += (char) XBOX_BINARY_FRAME_SIZE;
+			for (int j = 3; j < XBOX_BINARY_FRAME_SIZE; j++) {
+				s += (char) rng.below(256);
+			}
+		}
+		if (aEnds) {
+			aEnds->push_back(s.size() - 1);
+		}
+	}
+	return s;
+}
+
+struct PumpMode {
+	const char *name;
+	boolean greedy;
+	void (*pump)(StreamParserBase&);
+};
+
+static void pumpRun(StreamParserBase &aParser) {
+	aParser.run();
+}
+
+static void pumpRunBulk(StreamParserBase &aParser) {
+	aParser.runBulk();
+}
+
+static PumpMode modes[] = {
+		{ "run()", false, pumpRun },
+		{ "run() greedy", true, pumpRun },
+		{ "runBulk()", false, pumpRunBulk },
+		{ "runBulk() greedy", true, pumpRunBulk }
+};
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+/////////////   throughput
+
+static uint32_t framesSeen;
+
+static void countFrame(void*, char*, int) {
+	framesSeen++;
+}
+static void ignore(char*) {
+}
+
+static void throughput() {
+	std::string traffic = recordedTraffic(200000, NULL);
+	printf("\nThroughput, %lu bytes of recorded traffic all there at once\n", (unsigned long) traffic.size());
+	printf("  %-22s %12s %12s %10s\n", "mode", "MB/s", "frames/s", "ns/byte");
+	for (size_t m = 0; m < NUM_MODES; m++) {
+		double best = 0;
+		for (int rep = 0; rep < 3; rep++) {
+			MockStream in;
+			in.setInput(traffic);
+			StreamParser parser(&in, ignore);
+			parser.setContextCallback(countFrame, NULL);
+			parser.setRawContextCallback(countFrame, NULL);
+			parser.setGreedy(true);
+			framesSeen = 0;
+			BenchTimer timer;
+			while (!in.finished()) {
+				modes[m].pump(parser);
+			}
+			double seconds = timer.seconds();
+			if ((best == 0) || (seconds < best)) {
+				best = seconds;
+			}
+		}
+		printf("  %-22s %12.1f %12.0f %10.2f\n", modes[m].name, traffic.size() / best / 1e6,
+				framesSeen / best, best * 1e9 / traffic.size());
+	}
+}
+
+/////////////   latency behind a busy loop
+
+struct LatencyRun {
+	MockStream *in;
+	std::vector<size_t> *ends;
+	size_t next;
+	std::vector<uint32_t> latencies;
+};
+
+static void timeFrame(void *aContext, char*, int) {
+	LatencyRun *run = (LatencyRun*) aContext;
+	if (run->next < run->ends->size()) {
+		uint32_t arrived = run->in->arrivalMicros((*run->ends)[run->next++]);
+		run->latencies.push_back(micros() - arrived);
+	}
+}
+
+//  The line runs at 115200 and the sketch only gets back to the parser
+//  once every loop period.  Latency is from the frame's last byte coming
+//  in to its callback, on the mock clock.  Backlog is the most bytes that
+//  were ever waiting, past 64 a real serial buffer would have lost some.
+static void latency() {
+	static const uint32_t loopMicros[] = { 500, 2000, 10000 };
+	std::vector<size_t> ends;
+	std::string traffic = recordedTraffic(400, &ends);
+	printf("\nCallback latency at 115200 baud behind a busy loop (mock clock)\n");
+	printf("  %-22s %8s %10s %10s %10s %9s\n", "mode", "loop us", "p50 us", "p99 us", "max us", "backlog");
+	for (size_t m = 0; m < NUM_MODES; m++) {
+		for (size_t l = 0; l < sizeof(loopMicros) / sizeof(loopMicros[0]); l++) {
+			mockMicros = 0;
+			MockStream in;
+			in.setBaud(115200);
+			in.setInput(traffic);
+			LatencyRun run;
+			run.in = &in;
+			run.ends = &ends;
+			run.next = 0;
+			StreamParser parser(&in, ignore);
+			parser.setContextCallback(timeFrame, &run);
+			parser.setRawContextCallback(timeFrame, &run);
+			parser.setGreedy(modes[m].greedy);
+			int backlog = 0;
+			while (!in.finished()) {
+				mockAdvance(loopMicros[l]);
+				if (in.available() > backlog) {
+					backlog = in.available();
+				}
+				modes[m].pump(parser);
+			}
+			printf("  %-22s %8lu %10lu %10lu %10lu %8d%s\n", modes[m].name, (unsigned long) loopMicros[l],
+					(unsigned long) percentile(run.latencies, 50), (unsigned long) percentile(run.latencies, 99),
+					(unsigned long) percentile(run.latencies, 100), backlog, (backlog > 64) ? "!" : "");
+		}
+	}
+}
+
+/////////////   corruption
+
+//  Flips random bytes in the recorded traffic.  Worst resync is the most
+//  bytes thrown away in a row before a good frame came through again.
+//  Overflow and bad length counts are frames that claimed more room than
+//  the buffer has; the guard bytes around the buffer say whether anything
+//  actually got written past it.
+static void corruption() {
+	static const int ratesPerMillion[] = { 0, 100, 1000, 10000 };
+	std::vector<size_t> ends;
+	std::string clean = recordedTraffic(20000, &ends);
+	printf("\nCorrupted line, %lu frames through a 64 byte buffer\n", (unsigned long) ends.size());
+	printf("  %-10s %10s %10s %12s %10s %10s %8s\n", "bad bytes", "delivered", "discarded", "worst resync",
+			"overflows", "badLength", "overrun");
+	for (size_t r = 0; r < sizeof(ratesPerMillion) / sizeof(ratesPerMillion[0]); r++) {
+		FuzzRandom rng(7 + r);
+		std::string traffic = clean;
+		for (size_t i = 0; i < traffic.size(); i++) {
+			if (rng.below(1000000) < (uint32_t) ratesPerMillion[r]) {
+				traffic[i] = (char) rng.below(256);
+			}
+		}
+		std::vector<char> memory(64 + 2 * GUARD_SIZE, GUARD_BYTE);
+		StreamParserBase parser;
+		parser.attach(NULL, '<', '>', ignore, &memory[GUARD_SIZE], 64);
+		parser.handleBlock(traffic.data(), traffic.size());
+		boolean overrun = false;
+		for (int i = 0; i < GUARD_SIZE; i++) {
+			if ((memory[i] != GUARD_BYTE) || (memory[GUARD_SIZE + 64 + i] != GUARD_BYTE)) {
+				overrun = true;
+			}
+		}
+		const StreamParserStats &s = parser.getStats();
+		char rate[16];
+		snprintf(rate, sizeof(rate), "%.2f%%", ratesPerMillion[r] / 10000.0);
+		printf("  %-10s %10lu %10lu %12u %10u %10u %8s\n", rate, (unsigned long) s.frames,
+				(unsigned long) s.discarded, s.maxResync, s.overflows, s.badLengths, (overrun) ? "YES" : "no");
+	}
+}
+
+int main() {
+	printf("StreamParser benchmark, buffer %d, chunk %d\n", STREAMPARSER_BUFFER_SIZE, STREAMPARSER_CHUNK_SIZE);
+	throughput();
+	latency();
+	corruption();
+	return 0;
+}
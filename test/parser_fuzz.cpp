@@ -0,0 +1,391 @@
+/*
+
+parser_fuzz  --  Throws random and broken byte streams at the framing
+                 parsers and checks that every way of feeding them gives
+                 the same frames, and that none of them write outside
+                 their buffers.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "MockStream.h"
+#include "StreamParser.h"
+#include "CommandParser.h"
+#include "RadioCommon.h"
+#include "fuzz_common.h"
+
+#include <string>
+#include <vector>
+
+RH_RF95 radio;
+
+//  RadioCommon wants these from the sketch, the fuzz uses its own links
+void handleRawRadio(uint8_t*) {
+}
+void handleRadioCommand(char*) {
+}
+
+static int failures = 0;
+
+static void fail(const char *aWhat, uint32_t aSeed) {
+	failures++;
+	if (failures <= 20) {
+		printf("FAIL %s, seed %lu\n", aWhat, (unsigned long) aSeed);
+	}
+}
+
+/////////////   StreamParser
+
+//  A parser working out of a buffer with guard bytes on both sides
+struct GuardedParser {
+	std::vector<char> memory;
+	int size;
+	StreamParserBase parser;
+	std::vector<std::string> frames;
+
+	static void onFrame(void *aContext, char *aFrame, int aLength) {
+		GuardedParser *self = (GuardedParser*) aContext;
+		self->frames.push_back(std::string(1, 'A') + std::string(aFrame, aLength));
+		if (aLength >= self->size) {
+			self->frames.push_back("length past the buffer");
+		}
+	}
+	static void onRaw(void *aContext, char *aFrame, int aLength) {
+		GuardedParser *self = (GuardedParser*) aContext;
+		self->frames.push_back(std::string(1, 'R') + std::string(aFrame, aLength));
+		if (aLength >= self->size) {
+			self->frames.push_back("length past the buffer");
+		}
+	}
+	static void unused(char*) {
+	}
+
+	GuardedParser(Stream *aIn, int aSize):memory(aSize + 2 * GUARD_SIZE, GUARD_BYTE), size(aSize) {
+		parser.attach(aIn, '<', '>', unused, &memory[GUARD_SIZE], aSize);
+		parser.setContextCallback(onFrame, this);
+		parser.setRawContextCallback(onRaw, this);
+	}
+	boolean guardsIntact() {
+		for (int i = 0; i < GUARD_SIZE; i++) {
+			if ((memory[i] != GUARD_BYTE) || (memory[GUARD_SIZE + size + i] != GUARD_BYTE)) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+static boolean sameStats(const StreamParserStats &a, const StreamParserStats &b) {
+	return (a.frames == b.frames) && (a.discarded == b.discarded) && (a.maxResync == b.maxResync)
+			&& (a.overflows == b.overflows) && (a.badLengths == b.badLengths);
+}
+
+//  handleChar a byte at a time is the reference.  handleBlock in random
+//  pieces, runBulk through a stream with a small FIFO, and run() with a
+//  byte budget all have to come out the same.
+//  The stats counters are 16 bit, the totals over a whole run aren't
+struct FuzzTotals {
+	uint32_t frames;
+	uint32_t discarded;
+	uint32_t overflows;
+	uint32_t badLengths;
+	uint16_t maxResync;
+};
+
+static void fuzzStreamParser(uint32_t aSeed, FuzzTotals &aTotals) {
+	FuzzRandom rng(aSeed);
+	int size = 4 + rng.below(80);
+	std::string input = randomStream(rng, size, 1 + rng.below(30), false);
+
+	GuardedParser byChar(NULL, size);
+	for (size_t i = 0; i < input.size(); i++) {
+		byChar.parser.handleChar(input[i]);
+	}
+
+	GuardedParser byBlock(NULL, size);
+	for (size_t i = 0; i < input.size();) {
+		size_t n = 1 + rng.below(70);
+		if (n > input.size() - i) {
+			n = input.size() - i;
+		}
+		byBlock.parser.handleBlock(input.data() + i, n);
+		i += n;
+	}
+
+	MockStream bulkIn;
+	bulkIn.setInput(input);
+	bulkIn.setMaxAvailable(1 + rng.below(64));
+	GuardedParser bulk(&bulkIn, size);
+	bulk.parser.setGreedy(rng.below(2));
+	while (!bulkIn.finished()) {
+		bulk.parser.runBulk();
+	}
+
+	MockStream budgetIn;
+	budgetIn.setInput(input);
+	GuardedParser budget(&budgetIn, size);
+	while (!budgetIn.finished()) {
+		budget.parser.run(1 + rng.below(16));
+	}
+
+	GuardedParser *all[] = { &byChar, &byBlock, &bulk, &budget };
+	const char *names[] = { "handleChar", "handleBlock", "runBulk", "run(budget)" };
+	for (int i = 0; i < 4; i++) {
+		if (!all[i]->guardsIntact()) {
+			char what[64];
+			snprintf(what, sizeof(what), "%s wrote outside its buffer", names[i]);
+			fail(what, aSeed);
+		}
+		for (size_t f = 0; f < all[i]->frames.size(); f++) {
+			if (all[i]->frames[f] == "length past the buffer") {
+				char what[64];
+				snprintf(what, sizeof(what), "%s gave a frame as long as its buffer", names[i]);
+				fail(what, aSeed);
+			}
+		}
+		if (i == 0) {
+			continue;
+		}
+		if (all[i]->frames != byChar.frames) {
+			char what[64];
+			snprintf(what, sizeof(what), "%s frames differ from handleChar", names[i]);
+			fail(what, aSeed);
+		}
+		if (!sameStats(all[i]->parser.getStats(), byChar.parser.getStats())) {
+			char what[64];
+			snprintf(what, sizeof(what), "%s stats differ from handleChar", names[i]);
+			fail(what, aSeed);
+		}
+	}
+
+	const StreamParserStats &s = byChar.parser.getStats();
+	aTotals.frames += s.frames;
+	aTotals.discarded += s.discarded;
+	aTotals.overflows += s.overflows;
+	aTotals.badLengths += s.badLengths;
+	if (s.maxResync > aTotals.maxResync) {
+		aTotals.maxResync = s.maxResync;
+	}
+}
+
+/////////////   CommandParser
+
+static std::vector<std::string> *commandLog;
+
+static void logCommand(char *aCommand) {
+	std::string s(aCommand);
+	// the string parser leaves the end marker on, the frame parser doesn't
+	if (!s.empty() && (s[s.size() - 1] == END_OF_PACKET)) {
+		s.resize(s.size() - 1);
+	}
+	commandLog->push_back(s);
+}
+static void logArgs(char *aCommand, CommandArgs &aArgs) {
+	logCommand(aCommand);
+	char buf[48];
+	snprintf(buf, sizeof(buf), "args %d %ld %ld", aArgs.count, (long) aArgs.values[0], (long) aArgs.values[1]);
+	commandLog->push_back(buf);
+}
+
+static Command fuzzCommands[] = {
+		Command('A', logCommand),
+		Command('C', logCommand),
+		Command('#', logCommand)
+};
+static ExtendedCommand fuzzExtended[] = {
+		ExtendedCommand('B', logArgs, "dd"),
+		ExtendedCommand("CX", logCommand)
+};
+
+static CommandParser *stringSide;
+
+static void stringCallback(char *aFrame) {
+	stringSide->parseCommandString(aFrame);
+}
+
+//  parseCommandFrames over a whole buffer has to run the same commands
+//  as a StreamParser feeding parseCommandString, and can't touch anything
+//  past the length it was given.
+static void fuzzCommandFrames(uint32_t aSeed) {
+	FuzzRandom rng(aSeed);
+	std::string input = randomStream(rng, 64, 1 + rng.below(20), true);
+
+	std::vector<std::string> viaString;
+	std::vector<std::string> viaFrames;
+
+	CommandParser stringParser(fuzzCommands, NUM_ELEMENTS(fuzzCommands), fuzzExtended,
+			NUM_ELEMENTS(fuzzExtended), true);
+	stringSide = &stringParser;
+	char spBuffer[64];
+	StreamParserBase sp;
+	sp.attach(NULL, '<', '>', stringCallback, spBuffer, sizeof(spBuffer));
+	commandLog = &viaString;
+	sp.handleBlock(input.data(), input.size());
+
+	CommandParser frameParser(fuzzCommands, NUM_ELEMENTS(fuzzCommands), fuzzExtended,
+			NUM_ELEMENTS(fuzzExtended), true);
+	std::vector<char> memory(input.size() + GUARD_SIZE, GUARD_BYTE);
+	memcpy(&memory[0], input.data(), input.size());
+	commandLog = &viaFrames;
+	int used = frameParser.parseCommandFrames(&memory[0], input.size());
+
+	if (viaFrames != viaString) {
+		fail("parseCommandFrames ran different commands than parseCommandString", aSeed);
+	}
+	if (memcmp(&memory[0], input.data(), input.size()) != 0) {
+		fail("parseCommandFrames didn't put the buffer back", aSeed);
+	}
+	for (int i = 0; i < GUARD_SIZE; i++) {
+		if (memory[input.size() + i] != GUARD_BYTE) {
+			fail("parseCommandFrames wrote past aLength", aSeed);
+			break;
+		}
+	}
+	if ((used < 0) || (used > (int) input.size())) {
+		fail("parseCommandFrames used more than it was given", aSeed);
+	}
+}
+
+//  Which command runs for a key, the same with or without the table
+static std::string dispatched;
+
+static void ranA(char*) { dispatched += "A "; }
+static void ranC(char*) { dispatched += "C "; }
+static void ranM(char*) { dispatched += "M "; }
+static void ranDigit(char*) { dispatched += "# "; }
+static void ranMS(char*) { dispatched += "MS "; }
+static void ranMSX(char*) { dispatched += "MSX "; }
+static void ranMT(char*) { dispatched += "MT "; }
+static void ran7Z(char*) { dispatched += "7Z "; }
+static void ranContext(void *aContext, char*) { dispatched += (const char*) aContext; }
+static void ranArgs(char*, CommandArgs &aArgs) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "B%ld,%ld ", (long) aArgs.values[0], (long) aArgs.values[1]);
+	dispatched += buf;
+}
+
+static void checkDispatch() {
+	Command plain[] = {
+			Command('A', ranA),
+			Command('M', ranM),
+			Command('#', ranDigit),
+			Command('C', ranC)
+	};
+	ExtendedCommand extended[] = {
+			ExtendedCommand("MS", ranMS),
+			ExtendedCommand('A', ranContext, (void*) "shadowed "),
+			ExtendedCommand("MSX", ranMSX),
+			ExtendedCommand("MSX", ranMS),
+			ExtendedCommand('B', ranArgs, "dd"),
+			ExtendedCommand('Q', ranContext, (void*) "Q "),
+			ExtendedCommand('q', ranContext, (void*) "q "),
+			ExtendedCommand("7Z", ran7Z),
+			ExtendedCommand("MT", ranMT)
+	};
+	static const char *cases[][2] = {
+			{ "A1", "A " }, { "MSX", "MSX " }, { "MSX9", "MSX " }, { "MS", "MS " }, { "MSY", "MS " },
+			{ "MT", "MT " }, { "M5", "M " }, { "Mx", "M " }, { "B3,-4", "B3,-4 " }, { "B3", "" },
+			{ "Q", "Q " }, { "q", "q " }, { "7Z", "7Z " }, { "7", "# " }, { "75", "# " }, { "C", "C " },
+			{ "Z", "" }, { "", "" }
+	};
+	CommandParser parser(plain, NUM_ELEMENTS(plain), extended, NUM_ELEMENTS(extended));
+	for (size_t i = 0; i < NUM_ELEMENTS(cases); i++) {
+		char command[16];
+		strcpy(command, cases[i][0]);
+		dispatched.clear();
+		parser.parseCommandString(command);
+		if (dispatched != cases[i][1]) {
+			char what[96];
+			snprintf(what, sizeof(what), "\"%s\" ran \"%s\", not \"%s\"", cases[i][0], dispatched.c_str(),
+					cases[i][1]);
+			fail(what, 0);
+		}
+	}
+}
+
+/////////////   RadioLink
+
+static std::vector<std::string> *radioLog;
+
+static void logRadioRaw(uint8_t *aFrame) {
+	radioLog->push_back(std::string("R") + std::string((char*) aFrame, aFrame[2]));
+}
+static void logRadioCommand(char *aCommand) {
+	radioLog->push_back(std::string("A") + aCommand);
+}
+
+//  Commands can be split across packets anywhere, so cutting the same
+//  bytes into different packets can't change what comes out.
+static void fuzzRadioLink(uint32_t aSeed) {
+	FuzzRandom rng(aSeed);
+	std::string input = randomStream(rng, RADIO_COMMAND_BUFFER_SIZE, 1 + rng.below(20), false);
+
+	std::vector<std::string> whole;
+	std::vector<std::string> pieces;
+
+	RadioLink wholeLink(logRadioRaw, logRadioCommand);
+	radioLog = &whole;
+	for (size_t i = 0; i < input.size(); i += MAX_MESSAGE_SIZE_RH) {
+		size_t n = input.size() - i;
+		if (n > MAX_MESSAGE_SIZE_RH) {
+			n = MAX_MESSAGE_SIZE_RH;
+		}
+		std::vector<uint8_t> packet(input.begin() + i, input.begin() + i + n);
+		wholeLink.process(&packet[0], n);
+	}
+
+	RadioLink pieceLink(logRadioRaw, logRadioCommand);
+	radioLog = &pieces;
+	for (size_t i = 0; i < input.size();) {
+		size_t n = 1 + rng.below(40);
+		if (n > input.size() - i) {
+			n = input.size() - i;
+		}
+		// exactly sized so the sanitizer catches any read past the packet
+		std::vector<uint8_t> packet(input.begin() + i, input.begin() + i + n);
+		pieceLink.process(&packet[0], n);
+		i += n;
+	}
+
+	if (whole != pieces) {
+		fail("RadioLink gave different frames depending on the packet boundaries", aSeed);
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t runs = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+	uint32_t firstSeed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+	checkDispatch();
+	FuzzTotals totals = { 0, 0, 0, 0, 0 };
+	for (uint32_t i = 0; i < runs; i++) {
+		fuzzStreamParser(firstSeed + i, totals);
+		fuzzCommandFrames(firstSeed + i);
+		fuzzRadioLink(firstSeed + i);
+	}
+
+	printf("parser_fuzz: %lu streams, %lu frames, %lu bytes discarded, worst resync %u bytes,"
+			" %lu ascii overflow bytes, %lu bad raw lengths\n",
+			(unsigned long) runs, (unsigned long) totals.frames, (unsigned long) totals.discarded,
+			totals.maxResync, (unsigned long) totals.overflows, (unsigned long) totals.badLengths);
+	if (failures) {
+		printf("parser_fuzz: %d FAILURES\n", failures);
+		return 1;
+	}
+	printf("parser_fuzz: OK\n");
+	return 0;
+}
@@ -0,0 +1,323 @@
+/*
+
+parser_hub  --  Checks StreamParserHub: each link's quota, the round robin
+                order with and without a time budget, running out of
+                arena, and that every link stays inside its own piece of it.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "MockStream.h"
+#include "StreamParserHub.h"
+#include "fuzz_common.h"
+
+#include <string>
+#include <vector>
+
+//  Three real links with a guard link on each side of every one
+#define FUZZ_LINKS 7
+
+//  The Makefile builds this with room for them
+#if STREAMPARSER_HUB_MAX_LINKS < FUZZ_LINKS
+#error "parser_hub needs STREAMPARSER_HUB_MAX_LINKS of at least 7"
+#endif
+
+static int failures = 0;
+
+static void fail(const char *aWhat, uint32_t aSeed) {
+	failures++;
+	if (failures <= 20) {
+		printf("FAIL %s, seed %lu\n", aWhat, (unsigned long) aSeed);
+	}
+}
+
+static void unused(char*) {
+}
+
+//  What one link handed up, and where its buffer was
+struct LinkLog {
+	int id;
+	std::vector<int> *order;
+	std::vector<std::string> frames;
+	char *buffer;
+	uint32_t frameMicros;   // mock time each frame takes to handle
+
+	LinkLog():id(0), order(NULL), buffer(NULL), frameMicros(0){};
+
+	static void onFrame(void *aContext, char *aFrame, int aLength) {
+		LinkLog *self = (LinkLog*) aContext;
+		self->frames.push_back(std::string(1, 'A') + std::string(aFrame, aLength));
+		self->buffer = aFrame;
+		if (self->order) {
+			self->order->push_back(self->id);
+		}
+		mockAdvance(self->frameMicros);
+	}
+	static void onRaw(void *aContext, char *aFrame, int aLength) {
+		LinkLog *self = (LinkLog*) aContext;
+		self->frames.push_back(std::string(1, 'R') + std::string(aFrame, aLength));
+		self->buffer = aFrame;
+	}
+
+	void listen(StreamParserBase *aParser) {
+		aParser->setContextCallback(onFrame, this);
+		aParser->setRawContextCallback(onRaw, this);
+	}
+};
+
+/////////////   arena and links
+
+static void arenaLimits() {
+	StreamParserHub hub;
+	MockStream in;
+	if (hub.addStream(&in, unused, 3, 1) != -1) {
+		fail("took a buffer too small for a raw header", 0);
+	}
+	if (hub.addStream(&in, unused, STREAMPARSER_HUB_ARENA_SIZE + 1, 1) != -1) {
+		fail("took a buffer bigger than the whole arena", 0);
+	}
+	int half = STREAMPARSER_HUB_ARENA_SIZE / 2;
+	if ((hub.addStream(&in, unused, half, 1) != 0) || (hub.getArenaFree() != STREAMPARSER_HUB_ARENA_SIZE - half)) {
+		fail("first link didn't get the front of the arena", 0);
+	}
+	if (hub.addStream(&in, unused, STREAMPARSER_HUB_ARENA_SIZE - half + 1, 1) != -1) {
+		fail("took a buffer one byte past what was left", 0);
+	}
+	if (hub.addStream(&in, unused, STREAMPARSER_HUB_ARENA_SIZE - half, 1) != 1) {
+		fail("didn't take a buffer that exactly fills the arena", 0);
+	}
+	if ((hub.getArenaFree() != 0) || (hub.addStream(&in, unused, 4, 1) != -1)) {
+		fail("took a link with the arena full", 0);
+	}
+	if (hub.getNumLinks() != 2) {
+		fail("a refused link got counted", 0);
+	}
+
+	StreamParserHub full;
+	for (int i = 0; i < STREAMPARSER_HUB_MAX_LINKS; i++) {
+		if (full.addStream(&in, unused, 4, 1) != i) {
+			fail("link index isn't the order it was added", 0);
+		}
+	}
+	if (full.addStream(&in, unused, 4, 1) != -1) {
+		fail("took more than STREAMPARSER_HUB_MAX_LINKS links", 0);
+	}
+}
+
+/////////////   quotas
+
+static void quotas() {
+	for (int bulk = 0; bulk < 2; bulk++) {
+		MockStream a, b;
+		a.setInput(std::string(100, 'x'));
+		b.setInput(std::string(100, 'x'));
+		StreamParserHub hub;
+		hub.addStream(&a, unused, 16, 5);
+		hub.addStream(&b, unused, 16, 40);
+		hub.setBulk(bulk);
+		hub.run();
+		if ((hub.getBytesServiced(0) != 5) || (hub.getBytesServiced(1) != 40)) {
+			fail((bulk) ? "bulk read past its quota" : "read past its quota", 0);
+		}
+		if ((hub.getBacklog(0) != 95) || (hub.getBacklog(1) != 60)) {
+			fail("backlog isn't what the quota left behind", 0);
+		}
+		hub.setQuota(0, 0);
+		hub.run();
+		if (hub.getBytesServiced(0) != 6) {
+			fail("a quota of 0 should still move one byte", 0);
+		}
+		hub.run();
+		if ((hub.getMaxBacklog(1) != 60) || (hub.getBacklog(1) != 0)) {
+			fail("max backlog should stay at the worst one", 0);
+		}
+	}
+}
+
+/////////////   round robin
+
+//  Every link has plenty of 3 byte frames and a quota of 3, so each visit
+//  hands up exactly one frame and the log is the visiting order.
+struct RoundRobin {
+	MockStream in[3];
+	LinkLog logs[3];
+	std::vector<int> order;
+	StreamParserHub hub;
+
+	RoundRobin(uint32_t aFrameMicros) {
+		std::string frames;
+		for (int i = 0; i < 50; i++) {
+			frames += "<a>";
+		}
+		for (int i = 0; i < 3; i++) {
+			in[i].setInput(frames);
+			hub.addStream(&in[i], unused, 8, 3);
+			logs[i].id = i;
+			logs[i].order = &order;
+			logs[i].frameMicros = aFrameMicros;
+			logs[i].listen(hub.getParser(i));
+		}
+	}
+	std::string run(uint32_t aMaxMicros) {
+		order.clear();
+		hub.run(aMaxMicros);
+		std::string s;
+		for (size_t i = 0; i < order.size(); i++) {
+			s += (char) ('0' + order[i]);
+		}
+		return s;
+	}
+};
+
+static void roundRobin() {
+	RoundRobin full(0);
+	static const char *fullRounds[] = { "012", "120", "201", "012" };
+	for (int r = 0; r < 4; r++) {
+		if (full.run(0) != fullRounds[r]) {
+			fail("full rounds don't rotate who goes first", r);
+		}
+	}
+
+	// 100us a frame against a 150us budget, each round gets two links in
+	RoundRobin cut(100);
+	static const char *cutRounds[] = { "01", "20", "12", "01" };
+	for (int r = 0; r < 4; r++) {
+		if (cut.run(150) != cutRounds[r]) {
+			fail("a round cut short didn't resume with the skipped link", r);
+		}
+	}
+	// the budget running out mid round then a full one
+	RoundRobin mixed(100);
+	if ((mixed.run(150) != "01") || (mixed.run(0) != "201") || (mixed.run(0) != "012")) {
+		fail("a full round after a cut one doesn't rotate from where it resumed", 0);
+	}
+}
+
+/////////////   buffers stay apart
+
+//  Real links with guard links between and around them.  Each guard is fed
+//  one frame that fills its buffer, what's left in there afterwards has to
+//  stay put while the real links take random traffic.
+static void fuzzArena(uint32_t aSeed) {
+	FuzzRandom rng(aSeed);
+	StreamParserHub hub;
+	MockStream in[FUZZ_LINKS];
+	LinkLog logs[FUZZ_LINKS];
+	std::string inputs[FUZZ_LINKS];
+	int sizes[FUZZ_LINKS];
+
+	const int links = FUZZ_LINKS;
+	for (int i = 0; i < links; i++) {
+		boolean guard = ((i % 2) == 0);
+		sizes[i] = (guard) ? 4 + rng.below(8) : 4 + rng.below(40);
+		if (guard) {
+			inputs[i] = std::string(1, START_OF_PACKET) + std::string(sizes[i] - 3, 'G') + END_OF_PACKET;
+		} else {
+			inputs[i] = randomStream(rng, sizes[i], 1 + rng.below(20), false);
+		}
+		if (hub.addStream(&in[i], unused, sizes[i], 1 + rng.below(40)) != i) {
+			fail("ran out of arena setting up", aSeed);
+			return;
+		}
+		logs[i].listen(hub.getParser(i));
+	}
+	hub.setBulk(rng.below(2));
+
+	// guards first so their buffers can be snapshotted
+	for (int i = 0; i < links; i += 2) {
+		in[i].setInput(inputs[i]);
+	}
+	while (true) {
+		hub.run();
+		boolean done = true;
+		for (int i = 0; i < links; i += 2) {
+			done = done && in[i].finished();
+		}
+		if (done) {
+			break;
+		}
+	}
+	std::vector<std::string> snapshots(links);
+	for (int i = 0; i < links; i += 2) {
+		if ((logs[i].frames.size() != 1) || (logs[i].buffer == NULL)) {
+			fail("guard link didn't get its frame", aSeed);
+			return;
+		}
+		snapshots[i] = std::string(logs[i].buffer, sizes[i]);
+	}
+
+	for (int i = 1; i < links; i += 2) {
+		in[i].setInput(inputs[i]);
+		in[i].setMaxAvailable(1 + rng.below(64));
+	}
+	for (int rounds = 0; rounds < 100000; rounds++) {
+		hub.run();
+		boolean done = true;
+		for (int i = 1; i < links; i += 2) {
+			done = done && in[i].finished();
+		}
+		if (done) {
+			break;
+		}
+	}
+
+	for (int i = 0; i < links; i += 2) {
+		if (std::string(logs[i].buffer, sizes[i]) != snapshots[i]) {
+			fail("a link wrote outside its piece of the arena", aSeed);
+		}
+	}
+	// and each one has to come out like a parser on its own would
+	for (int i = 1; i < links; i += 2) {
+		std::vector<char> buffer(sizes[i]);
+		LinkLog alone;
+		StreamParserBase reference;
+		reference.attach(NULL, START_OF_PACKET, END_OF_PACKET, unused, &buffer[0], sizes[i]);
+		alone.listen(&reference);
+		for (size_t c = 0; c < inputs[i].size(); c++) {
+			reference.handleChar(inputs[i][c]);
+		}
+		if (alone.frames != logs[i].frames) {
+			fail("a link's frames differ from a parser on its own", aSeed);
+		}
+		for (size_t f = 0; f < logs[i].frames.size(); f++) {
+			if ((int) logs[i].frames[f].size() - 1 >= sizes[i]) {
+				fail("a frame as long as its link's buffer", aSeed);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t runs = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+	uint32_t firstSeed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+	arenaLimits();
+	quotas();
+	roundRobin();
+	for (uint32_t i = 0; i < runs; i++) {
+		fuzzArena(firstSeed + i);
+	}
+
+	printf("parser_hub: %d links in a %d byte arena, %lu random arenas\n", FUZZ_LINKS,
+			STREAMPARSER_HUB_ARENA_SIZE, (unsigned long) runs);
+	if (failures) {
+		printf("parser_hub: %d FAILURES\n", failures);
+		return 1;
+	}
+	printf("parser_hub: OK\n");
+	return 0;
+}
@@ -0,0 +1,337 @@
+/*
+
+radio_sim  --  Two copies of RadioCommon, a base and a robot, talking over
+               SimRadio on the mock clock.  Reports how long commands take
+               to get across and how much gets through for each setup.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#define RADIO_DRIVER_HEADER "SimRadio.h"
+#define RADIO_DRIVER_CLASS SimRadio
+
+//  Everything RadioCommon.h pulls in goes first so it stays out of the
+//  namespaces and both copies share it.
+#include "Arduino.h"
+#include <SPI.h>
+#include "SimRadio.h"
+#include <RobotSharedDefines.h>
+#include <ReedSolomon.h>
+#include "bench_common.h"
+#include "fuzz_common.h"
+
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static void heard(int aEnd, char *aCommand);
+
+namespace Base {
+#include "../RadioCommon.cpp"
+SimRadio radio;
+void handleRawRadio(uint8_t*) {
+}
+void handleRadioCommand(char *p) {
+	heard(0, p);
+}
+}
+
+#undef RADIOCOMMON_H_
+
+namespace Robot {
+#include "../RadioCommon.cpp"
+SimRadio radio;
+void handleRawRadio(uint8_t*) {
+}
+void handleRadioCommand(char *p) {
+	heard(1, p);
+}
+}
+
+//  One end's RadioCommon, whichever namespace it's in
+struct End {
+	SimRadio *radio;
+	void (*listen)();
+	void (*output)();
+	boolean (*queue)(uint8_t*, uint8_t);
+	boolean (*hold)(uint8_t*, uint8_t);
+	boolean (*urgent)(uint8_t*, uint8_t);
+	void (*config)(char*);
+	void (*policy)(int);
+	uint32_t (*onAir)(uint8_t);
+	uint16_t (*retransmits)();
+	uint16_t (*giveUps)();
+};
+
+#define END_OF(ns) { &ns::radio, ns::listenToRadio, ns::handleOutput, \
+	(boolean (*)(uint8_t*, uint8_t)) ns::queueToRadio, \
+	(boolean (*)(uint8_t*, uint8_t)) ns::addToHolding, \
+	(boolean (*)(uint8_t*, uint8_t)) ns::sendUrgent, \
+	ns::handleConfigString, \
+	[](int aPolicy) { ns::setHoldingPolicy((ns::HoldingPolicy) aPolicy); }, \
+	ns::loraTimeOnAir, \
+	[]() { return ns::getRadioStats().retransmits; }, \
+	[]() { return ns::getRadioStats().giveUps; } }
+
+static End ends[2] = { END_OF(Base), END_OF(Robot) };
+
+/////////////   traffic
+
+//  How the base hands its commands to RadioCommon
+enum SendMode {
+	SEND_QUEUE,      // queueToRadio, a packet each
+	SEND_HOLD,       // addToHolding, out on the flush interval or when full
+	SEND_ADAPTIVE,   // addToHolding with the adaptive flush on
+	SEND_URGENT      // sendUrgent
+};
+
+static const char *sendModeNames[] = { "queue", "hold", "adaptive", "urgent" };
+
+struct Scenario {
+	uint8_t preset;
+	SendMode mode;
+	uint32_t flushMillis;
+	uint16_t dutyPermille;      // 0 leaves it at the default, no limit unless it's adaptive
+	uint32_t commandMillis;     // base sends the robot a command this often
+	uint32_t telemetryMillis;   // and hears back from it this often
+	int16_t rssi;
+	double loss;
+	boolean reliable;
+	double byteErrors;          // chance each byte that gets through is damaged
+	boolean fec;
+};
+
+#define SIM_MILLIS 120000UL
+#define DRAIN_MILLIS 30000UL
+
+struct Results {
+	std::vector<uint32_t> sentAt;
+	std::vector<bool> seen;
+	std::vector<uint32_t> latencies;
+	uint32_t commandBytes;
+	uint32_t sourceDrops;
+	uint32_t telemetry;
+};
+
+static Results results;
+
+//  Commands are <Cnnnnn> so the robot can tell which one it got
+static void heard(int aEnd, char *aCommand) {
+	if ((aEnd == 1) && (aCommand[1] == 'C')) {
+		uint32_t id = strtoul(aCommand + 2, NULL, 10);
+		if ((id < results.sentAt.size()) && !results.seen[id]) {
+			results.seen[id] = true;
+			results.latencies.push_back(millis() - results.sentAt[id]);
+			results.commandBytes += strlen(aCommand);
+		}
+	} else if ((aEnd == 0) && (aCommand[1] == 'T')) {
+		results.telemetry++;
+	}
+}
+
+static boolean send(End &aEnd, SendMode aMode, char *aMessage) {
+	if (aMode == SEND_QUEUE) {
+		return aEnd.queue((uint8_t*) aMessage, strlen(aMessage));
+	}
+	if (aMode == SEND_URGENT) {
+		return aEnd.urgent((uint8_t*) aMessage, strlen(aMessage));
+	}
+	return aEnd.hold((uint8_t*) aMessage, strlen(aMessage));
+}
+
+static void configure(End &aEnd, const Scenario &aScenario) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "<%cM%u>", RADIO_CONFIG_CHAR, aScenario.preset);
+	aEnd.config(buf);
+	snprintf(buf, sizeof(buf), "<%cI%lu>", RADIO_CONFIG_CHAR, (unsigned long) aScenario.flushMillis);
+	aEnd.config(buf);
+	snprintf(buf, sizeof(buf), "<%cA%d>", RADIO_CONFIG_CHAR, (aScenario.mode == SEND_ADAPTIVE) ? 1 : 0);
+	aEnd.config(buf);
+	if (aScenario.dutyPermille > 0) {
+		snprintf(buf, sizeof(buf), "<%cD%u>", RADIO_CONFIG_CHAR, aScenario.dutyPermille);
+		aEnd.config(buf);
+	}
+	snprintf(buf, sizeof(buf), "<%cL%d>", RADIO_CONFIG_CHAR, (aScenario.reliable) ? 1 : 0);
+	aEnd.config(buf);
+	snprintf(buf, sizeof(buf), "<%cF%d>", RADIO_CONFIG_CHAR, (aScenario.fec) ? 1 : 0);
+	aEnd.config(buf);
+	// the sim can't block, the other end would stop with it
+	aEnd.policy(Base::HOLD_DROP_NEW);
+}
+
+//  Both ends get a turn every simulated millisecond.  Anything the
+//  radios make them wait on moves the clock along on its own.
+static void runScenario(const Scenario &aScenario) {
+	SimAir air;
+	air.rssi = aScenario.rssi;
+	air.lossProbability = aScenario.loss;
+	air.byteErrorProbability = aScenario.byteErrors;
+	ends[0].radio->attach(&air);
+	ends[1].radio->attach(&air);
+	configure(ends[0], aScenario);
+	configure(ends[1], aScenario);
+
+	// messages come along anywhere from half to one and a half periods
+	// apart, lined up the two ends would step on each other every time
+	FuzzRandom rng(aScenario.preset + 1);
+	uint32_t start = millis();
+	uint32_t nextCommand = start;
+	uint32_t nextTelemetry = start + rng.below(aScenario.telemetryMillis);
+	while (millis() - start < SIM_MILLIS + DRAIN_MILLIS) {
+		uint32_t now = millis();
+		if (now - start < SIM_MILLIS) {
+			if ((int32_t) (now - nextCommand) >= 0) {
+				char buf[16];
+				snprintf(buf, sizeof(buf), "<C%05lu>", (unsigned long) results.sentAt.size());
+				results.sentAt.push_back(now);
+				results.seen.push_back(false);
+				if (!send(ends[0], aScenario.mode, buf)) {
+					results.sourceDrops++;
+				}
+				nextCommand += (aScenario.commandMillis / 2) + rng.below(aScenario.commandMillis);
+			}
+			if ((int32_t) (now - nextTelemetry) >= 0) {
+				char buf[24];
+				snprintf(buf, sizeof(buf), "<T%lu,-97,12>", (unsigned long) now);
+				send(ends[1], SEND_HOLD, buf);
+				nextTelemetry += (aScenario.telemetryMillis / 2) + rng.below(aScenario.telemetryMillis);
+			}
+		}
+		for (int e = 0; e < 2; e++) {
+			ends[e].listen();
+			ends[e].output();
+		}
+		mockAdvance(1000);
+	}
+
+	uint32_t sent = results.sentAt.size();
+	uint32_t delivered = results.latencies.size();
+	const SimRadio::Counters &heardByRobot = ends[1].radio->getCounters();
+	char name[40];
+	int n = snprintf(name, sizeof(name), "M%u %s", aScenario.preset, sendModeNames[aScenario.mode]);
+	if (aScenario.dutyPermille > 0) {
+		n += snprintf(name + n, sizeof(name) - n, " D%u", aScenario.dutyPermille);
+	}
+	n += snprintf(name + n, sizeof(name) - n, "%s%s", (aScenario.reliable) ? " L1" : "", (aScenario.fec) ? " F1" : "");
+	if (aScenario.byteErrors > 0) {
+		snprintf(name + n, sizeof(name) - n, " e%.1f%%", aScenario.byteErrors * 100);
+	}
+	printf("  %-26s %5d %5.0f%% %6.1f%% %6.1f%% %6lu %6u %6u %7lu %7lu %7lu %8.1f %9lu\n", name, aScenario.rssi,
+			aScenario.loss * 100, 100.0 * delivered / sent, 100.0 * results.sourceDrops / sent,
+			(unsigned long) heardByRobot.halfDuplex, ends[0].retransmits(), ends[0].giveUps(),
+			(unsigned long) percentile(results.latencies, 50), (unsigned long) percentile(results.latencies, 99),
+			(unsigned long) percentile(results.latencies, 100), results.commandBytes * 1000.0 / SIM_MILLIS,
+			(unsigned long) results.telemetry);
+}
+
+//  Each one runs in its own process so both copies of RadioCommon start
+//  from scratch without needing a way to reset all their state.
+static void scenario(const Scenario &aScenario) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		runScenario(aScenario);
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+}
+
+static void header(const char *aTitle) {
+	printf("\n%s\n", aTitle);
+	printf("  %-26s %5s %6s %7s %7s %6s %6s %6s %7s %7s %7s %8s %9s\n", "setup", "rssi", "loss", "deliv", "dropped",
+			"halfdx", "resent", "gaveup", "p50 ms", "p99 ms", "max ms", "goodput", "telemetry");
+}
+
+/////////////   airtime model
+
+//  RadioCommon's own estimate against the simulated radio's
+static void airtimes() {
+	printf("\nAirtime, RadioCommon's loraTimeOnAir against the simulated radio (us)\n");
+	printf("  %-8s %10s %10s %10s %10s\n", "preset", "8 model", "8 sim", "64 model", "64 sim");
+	for (uint8_t preset = 0; preset <= 3; preset++) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "<%cM%u>", RADIO_CONFIG_CHAR, preset);
+		ends[0].config(buf);
+		printf("  M%-7u %10lu %10lu %10lu %10lu\n", preset, (unsigned long) ends[0].onAir(8),
+				(unsigned long) ends[0].radio->airtime(8), (unsigned long) ends[0].onAir(64),
+				(unsigned long) ends[0].radio->airtime(64));
+	}
+}
+
+int main() {
+	printf("RadioCommon over a simulated RH_RF95, %lu s of traffic on the mock clock\n", SIM_MILLIS / 1000);
+	printf("deliv is base to robot commands that got there, dropped is the ones the base's queue\n"
+			"turned away, halfdx is packets the robot missed because it was sending at the time,\n"
+			"resent and gaveup are the base's retransmits and packets it stopped trying in reliable mode (L1).\n"
+			"F1 is FEC on, eN%% is the chance each byte gets damaged on the way.\n"
+			"Latency is from the base's call to the robot's handler, goodput is command bytes/s.\n");
+	airtimes();
+
+	// adaptive gets a long flush interval so it's the one deciding
+	header("Presets and batching, a command every 100ms, telemetry back every 500ms,"
+			" 250ms flush or 2s with adaptive, D is a duty cycle set in permille, without one there's\n"
+			"  no limit except adaptive keeps to the default 100");
+	static const SendMode modes[] = { SEND_QUEUE, SEND_HOLD, SEND_ADAPTIVE };
+	static const uint16_t duties[] = { 0, 100 };
+	for (uint8_t preset = 0; preset <= 3; preset++) {
+		for (int d = 0; d < 2; d++) {
+			for (int m = 0; m < 3; m++) {
+				uint32_t flushMillis = (modes[m] == SEND_ADAPTIVE) ? 2000 : 250;
+				Scenario s = { preset, modes[m], flushMillis, duties[d], 100, 500, -100, 0, false, 0, false };
+				scenario(s);
+			}
+		}
+	}
+
+	header("Weak signal, a command and a telemetry frame every 5s, SNR floors SF7 (M0, M1) SF9 (M2) SF12 (M3)");
+	static const int16_t weak[] = { -115, -120, -125, -130, -135 };
+	for (size_t r = 0; r < sizeof(weak) / sizeof(weak[0]); r++) {
+		for (uint8_t preset = 0; preset <= 3; preset++) {
+			Scenario s = { preset, SEND_QUEUE, 250, 0, 5000, 5000, weak[r], 0, false, 0, false };
+			scenario(s);
+		}
+	}
+
+	header("Reliable mode against fire and forget under loss, M1, a command every 200ms, telemetry every 1s");
+	static const double losses[] = { 0, 0.05, 0.1, 0.2, 0.4 };
+	for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+		for (int reliable = 0; reliable < 2; reliable++) {
+			Scenario s = { 1, SEND_QUEUE, 250, 0, 200, 1000, -100, losses[l], reliable == 1, 0, false };
+			scenario(s);
+		}
+	}
+	// the urgent lane is numbered too, with only two slots to wait for acks in
+	// it gives up the oldest rather than block the next one
+	for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l += 2) {
+		for (int reliable = 0; reliable < 2; reliable++) {
+			Scenario s = { 1, SEND_URGENT, 250, 0, 200, 1000, -100, losses[l], reliable == 1, 0, false };
+			scenario(s);
+		}
+	}
+
+	header("FEC against damaged bytes, M1, a command every 200ms, telemetry every 1s");
+	static const double byteErrors[] = { 0, 0.002, 0.01, 0.03 };
+	for (size_t e = 0; e < sizeof(byteErrors) / sizeof(byteErrors[0]); e++) {
+		for (int fec = 0; fec < 2; fec++) {
+			Scenario s = { 1, SEND_QUEUE, 250, 0, 200, 1000, -100, 0, false, byteErrors[e], fec == 1 };
+			scenario(s);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+
+xbox_roundtrip  --  Controller state out through buildBinaryPacket, across
+                    a StreamParser with other traffic around it and back in
+                    through handleIncomingBinary has to come out byte for byte.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "StreamParser.h"
+#include "XboxHandler.h"
+#include "fuzz_common.h"
+
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void fail(const char *aWhat, uint32_t aSeed) {
+	failures++;
+	if (failures <= 20) {
+		printf("FAIL %s, seed %lu\n", aWhat, (unsigned long) aSeed);
+	}
+}
+
+//  Keeps what the handler held right after the frame that was sent, a raw
+//  frame out of the random traffic after it could pass the check bytes.
+struct Receiver {
+	XboxHandler xbox;
+	std::string expect;
+	boolean found;
+	ControllerUnion got;
+};
+
+static void onRaw(void *aContext, char *aFrame, int aLength) {
+	Receiver *r = (Receiver*) aContext;
+	r->xbox.handleIncomingBinary((uint8_t*) aFrame);
+	if (!r->found && (std::string(aFrame, aLength) == r->expect)) {
+		r->found = true;
+		r->got = r->xbox.getControllerUnion();
+	}
+}
+static void ignoreAscii(void*, char*, int) {
+}
+static void unused(char*) {
+}
+
+//  The sender's state goes in through the ascii path with every byte random,
+//  so '<', '>' and the raw codes all turn up inside the binary frame.
+static void roundTrip(uint32_t aSeed) {
+	FuzzRandom rng(aSeed);
+
+	ControllerUnion state;
+	for (int i = 0; i < XBOX_RAW_BUFFER_SIZE; i++) {
+		state.rawBuffer[i] = rng.below(256);
+	}
+	state.rawBuffer[0] = 0x14;
+	state.rawBuffer[1] = 0x0D;
+	char hex[2 * XBOX_RAW_BUFFER_SIZE + 1];
+	for (int i = 0; i < XBOX_RAW_BUFFER_SIZE; i++) {
+		snprintf(hex + 2 * i, 3, "%02X", state.rawBuffer[i]);
+	}
+	XboxHandler sender;
+	sender.handleIncomingASCII(hex);
+	if (memcmp(sender.getControllerUnion().rawBuffer, state.rawBuffer, XBOX_RAW_BUFFER_SIZE) != 0) {
+		fail("ascii path didn't load the sender", aSeed);
+		return;
+	}
+
+	uint8_t frame[XBOX_BINARY_FRAME_SIZE];
+	uint8_t len = sender.buildBinaryPacket(frame);
+	if (len != XBOX_BINARY_FRAME_SIZE) {
+		fail("buildBinaryPacket length", aSeed);
+		return;
+	}
+
+	// well formed traffic on both sides of it
+	std::string stream = randomStream(rng, STREAMPARSER_BUFFER_SIZE, rng.below(4), true);
+	stream.append((char*) frame, len);
+	stream += randomStream(rng, STREAMPARSER_BUFFER_SIZE, rng.below(4), true);
+
+	Receiver r;
+	r.expect = std::string((char*) frame, len);
+	r.found = false;
+	char buffer[STREAMPARSER_BUFFER_SIZE];
+	StreamParserBase parser;
+	parser.attach(NULL, START_OF_PACKET, END_OF_PACKET, unused, buffer, sizeof(buffer));
+	parser.setContextCallback(ignoreAscii, NULL);
+	parser.setRawContextCallback(onRaw, &r);
+	for (size_t i = 0; i < stream.size();) {
+		size_t n = 1 + rng.below(20);
+		if (n > stream.size() - i) {
+			n = stream.size() - i;
+		}
+		parser.handleBlock(stream.data() + i, n);
+		i += n;
+	}
+
+	if (!r.found) {
+		fail("binary frame didn't come through the parser intact", aSeed);
+		return;
+	}
+	if (memcmp(r.got.rawBuffer, state.rawBuffer, XBOX_RAW_BUFFER_SIZE) != 0) {
+		fail("receiver's ControllerUnion differs from the sender's", aSeed);
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t runs = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+	uint32_t firstSeed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+	for (uint32_t i = 0; i < runs; i++) {
+		roundTrip(firstSeed + i);
+	}
+
+	char ascii[64];
+	XboxHandler x;
+	x.rebuildPacket(ascii);
+	printf("xbox_roundtrip: %lu controller states, binary frame %d bytes, ascii frame %d bytes\n",
+			(unsigned long) runs, XBOX_BINARY_FRAME_SIZE, (int) strlen(ascii) + 1);
+	if (failures) {
+		printf("xbox_roundtrip: %d FAILURES\n", failures);
+		return 1;
+	}
+	printf("xbox_roundtrip: OK\n");
+	return 0;
+}
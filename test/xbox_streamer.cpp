@@ -0,0 +1,353 @@
+/*
+
+xbox_streamer  --  Checks XboxStreamer: noise inside the deadband stays
+                   quiet, moves past the threshold go out, the keepalive
+                   comes on time and coming back to center always sends.
+                   The frames go through a parser into a second handler
+                   and that has to end up close enough to the controller.
+     Copyright (C) 2020  David C.
+
+     This program is free software: you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation, either version 3 of the License, or
+     (at your option) any later version.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+     */
+
+#include "Arduino.h"
+#include "StreamParser.h"
+#include "XboxHandler.h"
+#include "XboxStreamer.h"
+#include "fuzz_common.h"
+
+//  How often the base would look at the controller
+#define POLL_MICROS 20000UL
+
+static int failures = 0;
+
+static void fail(const char *aWhat, uint32_t aSeed) {
+	failures++;
+	if (failures <= 20) {
+		printf("FAIL %s, seed %lu\n", aWhat, (unsigned long) aSeed);
+	}
+}
+
+static void onRaw(void *aContext, char *aFrame, int) {
+	((XboxHandler*) aContext)->handleIncomingBinary((uint8_t*) aFrame);
+}
+static void ignoreAscii(void*, char*, int) {
+}
+static void unused(char*) {
+}
+
+//  Controller on one end, streamer in the middle, parser and handler on
+//  the robot end.  Every poll is one encode, whatever it sends goes across.
+struct Link {
+	XboxHandler controller;
+	XboxStreamer streamer;
+	char buffer[STREAMPARSER_BUFFER_SIZE];
+	StreamParserBase parser;
+	XboxHandler robot;
+	uint32_t bytes;
+
+	Link(uint16_t aThreshold, uint32_t aKeepalive):streamer(aThreshold, aKeepalive), bytes(0) {
+		parser.attach(NULL, START_OF_PACKET, END_OF_PACKET, unused, buffer, sizeof(buffer));
+		parser.setContextCallback(ignoreAscii, NULL);
+		parser.setRawContextCallback(onRaw, &robot);
+	}
+
+	//  Loads the controller the same way the USB side would, a whole union at once
+	void set(const ControllerUnion &aState) {
+		uint8_t frame[XBOX_BINARY_FRAME_SIZE] = { START_OF_PACKET, XBOX_BINARY_CODE, XBOX_BINARY_FRAME_SIZE };
+		memcpy(frame + 3, aState.rawBuffer, XBOX_RAW_BUFFER_SIZE);
+		frame[3] = 0x14;
+		frame[4] = 0x0D;
+		controller.handleIncomingBinary(frame);
+	}
+
+	boolean poll() {
+		uint8_t frame[XBOX_BINARY_FRAME_SIZE];
+		uint8_t len = streamer.encode(controller, frame);
+		mockAdvance(POLL_MICROS);
+		if (len == 0) {
+			return false;
+		}
+		if (len != XBOX_BINARY_FRAME_SIZE) {
+			fail("encode returned the wrong length", 0);
+		}
+		parser.handleBlock((char*) frame, len);
+		bytes += len;
+		return true;
+	}
+
+	boolean setAndPoll(const ControllerUnion &aState) {
+		set(aState);
+		return poll();
+	}
+};
+
+static ControllerUnion centered() {
+	ControllerUnion state;
+	memset(state.rawBuffer, 0, XBOX_RAW_BUFFER_SIZE);
+	return state;
+}
+
+//  What the deadband makes of a hat value
+static int32_t zeroed(int16_t aValue) {
+	int32_t value = aValue;
+	return (abs(value) < DEFAULT_DEADBAND) ? 0 : value;
+}
+
+//  The robot never gets told about anything the streamer calls no change.
+//  Buttons and triggers have to match, the hats can be off by the
+//  threshold but both have to be centered or both not.
+static boolean closeEnough(Link &aLink, uint16_t aThreshold) {
+	const ControllerUnion &want = aLink.controller.getControllerUnion();
+	const ControllerUnion &got = aLink.robot.getControllerUnion();
+	if ((want.values.buttonState != got.values.buttonState)
+			|| (want.values.leftTrigger != got.values.leftTrigger)
+			|| (want.values.rightTrigger != got.values.rightTrigger)) {
+		return false;
+	}
+	for (int i = 0; i < NUMBER_HATS; i++) {
+		int32_t a = zeroed(want.values.hatValues[i]);
+		int32_t b = zeroed(got.values.hatValues[i]);
+		if (((a == 0) != (b == 0)) || (abs(a - b) > aThreshold)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/////////////   one thing at a time
+
+static void deadband() {
+	Link link(512, 1000);
+	ControllerUnion state = centered();
+	if (!link.setAndPoll(state)) {
+		fail("first frame didn't go out", 0);
+	}
+	// half a second of stick noise, short of the keepalive
+	FuzzRandom rng(1);
+	for (int p = 0; p < 25; p++) {
+		for (int i = 0; i < NUMBER_HATS; i++) {
+			state.values.hatValues[i] = (int16_t) rng.below(2 * DEFAULT_DEADBAND - 1) - (DEFAULT_DEADBAND - 1);
+		}
+		if (link.setAndPoll(state)) {
+			fail("noise inside the deadband got sent", p);
+		}
+	}
+	if (link.streamer.getSuppressedCount() != 25) {
+		fail("suppressed count doesn't match the polls that sent nothing", 0);
+	}
+}
+
+static void threshold() {
+	Link link(512, 1000);
+	ControllerUnion state = centered();
+	state.values.hatValues[LeftHatX] = 5000;
+	link.setAndPoll(state);
+	state.values.hatValues[LeftHatX] = 5000 + 512;
+	if (link.setAndPoll(state)) {
+		fail("a move of exactly the threshold got sent", 0);
+	}
+	state.values.hatValues[LeftHatX] = 5000 + 513;
+	if (!link.setAndPoll(state)) {
+		fail("a move past the threshold didn't get sent", 0);
+	}
+	// small steps count from the last one sent, so they still add up
+	int sent = 0;
+	for (int p = 1; p <= 6; p++) {
+		state.values.hatValues[LeftHatX] = 5513 + 100 * p;
+		sent += link.setAndPoll(state);
+	}
+	if ((sent != 1) || (link.robot.getHatValue(LeftHatX) != 6113)) {
+		fail("slow drift didn't go out once it added up past the threshold", sent);
+	}
+	state.values.buttonState = 0x0010;
+	if (!link.setAndPoll(state)) {
+		fail("a button didn't get sent", 0);
+	}
+	state.values.leftTrigger = 1;
+	if (!link.setAndPoll(state)) {
+		fail("a trigger didn't get sent", 0);
+	}
+}
+
+//  A threshold wider than any move so only the center rule can send
+static void returnToCenter() {
+	Link link(30000, 1000);
+	ControllerUnion state = centered();
+	static const int16_t walk[] = { 1100, 1000, 0, -32768, -28000, -1000, -DEFAULT_DEADBAND };
+	static const boolean sends[] = { true, true, false, true, false, true, true };
+	link.setAndPoll(state);
+	for (int s = 0; s < 7; s++) {
+		state.values.hatValues[RightHatX] = walk[s];
+		if (link.setAndPoll(state) != sends[s]) {
+			fail("into or out of the deadband", s);
+		}
+	}
+	if (link.robot.getHatValue(RightHatX) != -DEFAULT_DEADBAND) {
+		fail("robot didn't end up off center", 0);
+	}
+}
+
+static void keepalive() {
+	Link link(512, 1000);
+	uint32_t start = millis();
+	uint32_t last = start;
+	link.setAndPoll(centered());
+	int sent = 0;
+	while (millis() - start < 5000) {
+		uint32_t now = millis();
+		if (link.poll()) {
+			if (now - last < 1000) {
+				fail("keepalive went out early", now - last);
+			}
+			if (now - last > 1000 + POLL_MICROS / 1000) {
+				fail("keepalive went out late", now - last);
+			}
+			last = now;
+			sent++;
+		}
+	}
+	if (sent != 4) {
+		fail("wrong number of keepalives in 5 seconds", sent);
+	}
+	link.streamer.setKeepaliveInterval(250);
+	start = millis();
+	sent = 0;
+	while (millis() - start < 5000) {
+		sent += link.poll();
+	}
+	if ((sent < 19) || (sent > 20)) {
+		fail("shorter keepalive didn't take", sent);
+	}
+	link.streamer.forceNext();
+	if (!link.poll()) {
+		fail("forceNext didn't send", 0);
+	}
+}
+
+/////////////   traces
+
+//  Sticks resting with the noise a worn pot gives
+static void idleStep(FuzzRandom &rng, ControllerUnion &aState) {
+	for (int i = 0; i < NUMBER_HATS; i++) {
+		aState.values.hatValues[i] = (int16_t) rng.below(1601) - 800;
+	}
+}
+
+//  Sticks heading for a new spot now and then, sometimes back to center,
+//  the odd button and the triggers ramping like a thumb would.
+struct Driver {
+	int32_t target[NUMBER_HATS];
+	int32_t hats[NUMBER_HATS];
+	int triggerTarget;
+
+	Driver():triggerTarget(0) {
+		memset(target, 0, sizeof(target));
+		memset(hats, 0, sizeof(hats));
+	}
+
+	void step(FuzzRandom &rng, ControllerUnion &aState) {
+		if (rng.below(50) == 0) {
+			for (int i = 0; i < NUMBER_HATS; i++) {
+				target[i] = (rng.below(3) == 0) ? 0 : (int32_t) rng.below(65536) - 32768;
+			}
+			triggerTarget = (rng.below(2)) ? 255 : 0;
+		}
+		for (int i = 0; i < NUMBER_HATS; i++) {
+			int32_t d = target[i] - hats[i];
+			d = (d > 2000) ? 2000 : (d < -2000) ? -2000 : d;
+			hats[i] += d;
+			int32_t v = hats[i] + (int32_t) rng.below(401) - 200;
+			aState.values.hatValues[i] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : v;
+		}
+		int t = aState.values.rightTrigger;
+		t += (triggerTarget > t) ? 15 : (triggerTarget < t) ? -15 : 0;
+		aState.values.rightTrigger = (t < 0) ? 0 : (t > 255) ? 255 : t;
+		if (rng.below(100) == 0) {
+			aState.values.buttonState ^= 1 << rng.below(16);
+		}
+	}
+};
+
+static void drive(uint32_t aSeed) {
+	FuzzRandom rng(aSeed);
+	uint16_t thresholdValue = 64 + rng.below(2048);
+	Link link(thresholdValue, 200 + rng.below(2000));
+	ControllerUnion state = centered();
+	Driver driver;
+	for (int p = 0; p < 500; p++) {
+		if (rng.below(4) == 0) {
+			idleStep(rng, state);
+		} else {
+			driver.step(rng, state);
+		}
+		link.setAndPoll(state);
+		if (!closeEnough(link, thresholdValue)) {
+			fail("robot drifted further than the streamer allows", aSeed);
+			return;
+		}
+	}
+	link.streamer.forceNext();
+	link.poll();
+	if (memcmp(link.robot.getControllerUnion().rawBuffer, link.controller.getControllerUnion().rawBuffer,
+			XBOX_RAW_BUFFER_SIZE) != 0) {
+		fail("robot doesn't match the controller after a forced frame", aSeed);
+	}
+}
+
+//  A minute of each at the poll rate, with the defaults
+static void report(const char *aName, boolean aDriving) {
+	Link link(DEFAULT_HAT_THRESHOLD, DEFAULT_KEEPALIVE_INTERVAL);
+	FuzzRandom rng(42);
+	ControllerUnion state = centered();
+	Driver driver;
+	uint32_t polls = 60000000UL / POLL_MICROS;
+	for (uint32_t p = 0; p < polls; p++) {
+		if (aDriving) {
+			driver.step(rng, state);
+		} else {
+			idleStep(rng, state);
+		}
+		link.setAndPoll(state);
+	}
+	printf("xbox_streamer: %-8s %5lu polls, %5lu sent, %5lu suppressed, %6lu bytes instead of %lu\n", aName,
+			(unsigned long) polls, (unsigned long) link.streamer.getSentCount(),
+			(unsigned long) link.streamer.getSuppressedCount(), (unsigned long) link.bytes,
+			(unsigned long) (polls * XBOX_BINARY_FRAME_SIZE));
+}
+
+int main(int argc, char **argv) {
+	uint32_t runs = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000;
+	uint32_t firstSeed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+	deadband();
+	threshold();
+	returnToCenter();
+	keepalive();
+	for (uint32_t i = 0; i < runs; i++) {
+		drive(firstSeed + i);
+	}
+
+	printf("xbox_streamer: %lu driving traces, a minute each of idle and driving at %lums a poll\n",
+			(unsigned long) runs, POLL_MICROS / 1000);
+	report("idle", false);
+	report("driving", true);
+	if (failures) {
+		printf("xbox_streamer: %d FAILURES\n", failures);
+		return 1;
+	}
+	printf("xbox_streamer: OK\n");
+	return 0;
+}